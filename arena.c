@@ -0,0 +1,180 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ROUNDUP(n, a) (((n) + (a) - 1) & ~((size_t)(a) - 1))
+#define CHUNKHDR ROUNDUP(sizeof(struct chunk), ARENA_ALIGN)
+
+void
+arenaInit(struct arena *a)
+{
+    memset(a, 0, sizeof(*a));
+}
+
+/*
+ * returns n bytes of ARENA_ALIGN aligned memory, valid until the next
+ * arenaReset() or arenaFree().
+ * return values:
+ *  NULL: out of memory
+ */
+void *
+arenaAlloc(struct arena *a, size_t n)
+{
+    struct chunk *c = a->head;
+    void *p;
+
+    n = ROUNDUP(n ? n : 1, ARENA_ALIGN);
+
+    if (!c || c->size - c->used < n) {
+	size_t size = n > ARENA_CHUNK - CHUNKHDR ? n : ARENA_CHUNK - CHUNKHDR;
+
+	if ((c = malloc(CHUNKHDR + size)) == NULL) {
+	    return NULL;
+	}
+	c->size = size;
+	c->used = 0;
+	c->next = a->head;
+	a->head = c;
+
+	a->reserved += CHUNKHDR + size;
+	if (a->reserved > a->peak) {
+	    a->peak = a->reserved;
+	}
+    }
+
+    p = (char *)c + CHUNKHDR + c->used;
+    c->used += n;
+    a->used += n;
+
+    return p;
+}
+
+char *
+arenaStrndup(struct arena *a, const char *s, size_t len)
+{
+    char *p;
+
+    if ((p = arenaAlloc(a, len + 1)) == NULL) {
+	return NULL;
+    }
+    memcpy(p, s, len);
+    p[len] = '\0';
+
+    return p;
+}
+
+/*
+ * formats into a buffer sized exactly for the result.
+ * return values:
+ *  NULL: out of memory or bad format
+ */
+char *
+arenaPrintf(struct arena *a, const char *fmt, ...)
+{
+    va_list ap;
+    char *p;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    if (n < 0 || (p = arenaAlloc(a, (size_t)n + 1)) == NULL) {
+	return NULL;
+    }
+
+    va_start(ap, fmt);
+    (void)vsnprintf(p, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+
+    return p;
+}
+
+/*
+ * forgets every allocation but keeps the oldest chunk around, so the
+ * next request on the same connection does not go back to malloc.
+ */
+void
+arenaReset(struct arena *a)
+{
+    struct chunk *c, *next;
+
+    if (!a->head) {
+	return;
+    }
+
+    for (c = a->head; c->next; c = next) {
+	next = c->next;
+	a->reserved -= CHUNKHDR + c->size;
+	free(c);
+    }
+
+    c->used = 0;
+    a->head = c;
+    a->used = 0;
+}
+
+void
+arenaFree(struct arena *a)
+{
+    struct chunk *c, *next;
+
+    for (c = a->head; c; c = next) {
+	next = c->next;
+	free(c);
+    }
+
+    a->head = NULL;
+    a->used = 0;
+    a->reserved = 0;
+}
+
+void
+poolInit(struct pool *p, size_t objsize, size_t perslab)
+{
+    memset(p, 0, sizeof(*p));
+    p->objsize = ROUNDUP(objsize < sizeof(void *) ? sizeof(void *) : objsize,
+	ARENA_ALIGN);
+    p->perslab = perslab ? perslab : 1;
+}
+
+/*
+ * return values:
+ *  NULL: out of memory
+ */
+void *
+poolGet(struct pool *p)
+{
+    void *obj;
+
+    if (!p->freelist) {
+	char *slab;
+	size_t i;
+
+	if ((slab = malloc(p->objsize * p->perslab)) == NULL) {
+	    return NULL;
+	}
+	for (i = 0; i < p->perslab; i++) {
+	    *(void **)(slab + i * p->objsize) = p->freelist;
+	    p->freelist = slab + i * p->objsize;
+	}
+	p->slabs++;
+    }
+
+    obj = p->freelist;
+    p->freelist = *(void **)obj;
+    p->inuse++;
+
+    return obj;
+}
+
+void
+poolPut(struct pool *p, void *obj)
+{
+    *(void **)obj = p->freelist;
+    p->freelist = obj;
+    p->inuse--;
+}
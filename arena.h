@@ -0,0 +1,56 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+#ifndef ARENA_CHUNK
+#define ARENA_CHUNK 4096 /* one page; bigger requests get their own chunk */
+#endif
+
+#ifndef ARENA_ALIGN
+#define ARENA_ALIGN 16
+#endif
+
+struct chunk {
+    struct chunk *next;
+    size_t size;
+    size_t used;
+};
+
+/*
+ * per-request bump allocator.  Nothing is freed individually; the whole
+ * arena is reset between requests and released when the connection goes
+ * idle or closes.
+ */
+struct arena {
+    struct chunk *head;
+    size_t used;	/* bytes handed out since the last reset */
+    size_t reserved;	/* bytes currently malloc'd for chunks */
+    size_t peak;	/* high-water mark of reserved */
+};
+
+/*
+ * fixed-size object allocator.  Objects are carved out of slabs and
+ * recycled through a free list, slabs are never returned to malloc.
+ */
+struct pool {
+    size_t objsize;
+    size_t perslab;
+    void *freelist;
+    size_t inuse;
+    size_t slabs;
+};
+
+void arenaInit(struct arena *);
+void *arenaAlloc(struct arena *, size_t);
+char *arenaStrndup(struct arena *, const char *, size_t);
+char *arenaPrintf(struct arena *, const char *, ...)
+    __attribute__((format(printf, 2, 3)));
+void arenaReset(struct arena *);
+void arenaFree(struct arena *);
+
+void poolInit(struct pool *, size_t, size_t);
+void *poolGet(struct pool *);
+void poolPut(struct pool *, void *);
+
+#endif
@@ -0,0 +1,435 @@
+#!/usr/bin/env bash
+#
+# smoke tests for sws and its tools, one section per feature.  Every
+# server runs in the foreground (-d) on its own port from $PORT up, on
+# fixtures made in a scratch directory.  Needs bash (for /dev/tcp), curl
+# and gzip.  Run it through "make check".
+
+PORT=${PORT:-18080}
+BIN=$(cd "$(dirname "$0")" && pwd)
+TMP=$(mktemp -d "${TMPDIR:-/tmp}/sws-check.XXXXXX") || exit 1
+pids=()
+fail=0
+run=0
+
+cleanup() {
+    for pid in "${pids[@]}"; do
+	kill "$pid" 2>/dev/null
+    done
+    wait 2>/dev/null
+    rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+ok() {
+    run=$((run + 1))
+    echo "ok - $1"
+}
+
+notok() {
+    run=$((run + 1))
+    fail=$((fail + 1))
+    echo "not ok - $1"
+}
+
+# expect what got description
+expect() {
+    if [ "$2" = "$1" ]; then
+	ok "$3"
+    else
+	notok "$3 (wanted '$1', got '$2')"
+    fi
+}
+
+# status [curl options] url
+status() {
+    curl -s -o /dev/null -w '%{http_code}' --max-time 5 "$@"
+}
+
+# serve name sws-options...: starts sws on the next port, output to $TMP/name.out
+serve() {
+    local name=$1 i
+
+    shift
+    PORT=$((PORT + 1))
+    "$BIN/sws" -d -i 127.0.0.1 -p "$PORT" "$@" > "$TMP/$name.out" 2>&1 &
+    pids+=($!)
+    URL=http://127.0.0.1:$PORT
+    for i in $(seq 50); do
+	curl -s -o /dev/null --max-time 1 "$URL/" && return 0
+	sleep 0.1
+    done
+    notok "$name: sws did not come up"
+    return 1
+}
+
+# refuses sws-options...: sws must exit with an error instead of serving
+refuses() {
+    local pid i
+
+    "$BIN/sws" -d -i 127.0.0.1 -p "$((PORT + 1))" "$@" "$TMP/www" \
+	> /dev/null 2>&1 &
+    pid=$!
+    for i in $(seq 20); do
+	kill -0 "$pid" 2>/dev/null || break
+	sleep 0.1
+    done
+    if kill "$pid" 2>/dev/null; then
+	wait "$pid"
+	notok "refuses $*"
+    elif wait "$pid"; then
+	notok "refuses $* (exit 0)"
+    else
+	ok "refuses $*"
+    fi
+}
+
+# the docroot most checks serve; each adds what else it needs
+mkdir -p "$TMP/www/sub"
+echo 'body { color: red; }' > "$TMP/www/s.css"
+echo a > "$TMP/www/sub/a.txt"
+head -c 300000 /dev/urandom > "$TMP/www/big.bin"
+
+# file I/O: whole files come back byte for byte, however they are sent
+if serve fsio "$TMP/www"; then
+    curl -s --max-time 5 "$URL/big.bin" > "$TMP/big.out"
+    if cmp -s "$TMP/www/big.bin" "$TMP/big.out"; then
+	ok "big file comes back intact"
+    else
+	notok "big file comes back intact"
+    fi
+    expect 'body { color: red; }' "$(curl -s "$URL/s.css")" "small file"
+    expect 200 "$(status -I "$URL/s.css")" "HEAD"
+    expect 404 "$(status "$URL/nope")" "missing file"
+fi
+
+# request parsing: a method is matched whole, not by its prefix
+if serve parse "$TMP/www"; then
+    expect 501 "$(status -X HEADX "$URL/")" "method HEADX is not HEAD"
+    expect 501 "$(status -X GETTY "$URL/")" "method GETTY is not GET"
+    expect 501 "$(status -X GETGETGETGETGETGET "$URL/")" "overlong method"
+    expect 200 "$(status -H "X-Long: $(printf '%04000d' 0)" "$URL/s.css")" \
+	"long header line in the arena"
+fi
+
+# resolution beneath the docroot and the CGI directory
+mkdir -p "$TMP/cgi"
+ln -s sub/a.txt "$TMP/www/inlink"
+ln -s "$TMP/www/s.css" "$TMP/www/abslink"
+printf '#!/bin/sh\nprintf "Content-Type: text/plain\\r\\n\\r\\n"\necho "q=$QUERY_STRING"\n' \
+    > "$TMP/cgi/t.sh"
+chmod +x "$TMP/cgi/t.sh"
+if serve resolve -c "$TMP/cgi" "$TMP/www"; then
+    expect 403 "$(status --path-as-is "$URL/sub/../s.css")" ".. is forbidden"
+    expect 200 "$(status "$URL/inlink")" "relative symlink"
+    expect 403 "$(status "$URL/abslink")" "absolute symlink"
+    expect "q=x=1" "$(curl -s "$URL/cgi-bin/t.sh?x=1")" "CGI with a query"
+    expect 404 "$(status "$URL/cgi-bin/none.sh")" "missing CGI script"
+    expect 403 "$(status "$URL/~nosuchuser/x")" "unknown user"
+fi
+
+# upgrades: a download in flight finishes, the new process takes over
+if serve upgrade -b 200k "$TMP/www"; then
+    old=${pids[-1]}
+    curl -s --max-time 10 "$URL/big.bin" > "$TMP/upgrade.bin" &
+    fetch=$!
+    sleep 0.3
+    kill -HUP "$old"
+    for i in $(seq 50); do
+	kill -0 "$old" 2>/dev/null || break
+	sleep 0.1
+    done
+    pids+=($(pgrep -f "sws -d -i 127.0.0.1 -p $PORT "))
+    expect 200 "$(status "$URL/s.css")" "served after the upgrade"
+    if kill -0 "$old" 2>/dev/null; then
+	notok "old process exits"
+    else
+	ok "old process exits"
+    fi
+    wait "$fetch"
+    if cmp -s "$TMP/www/big.bin" "$TMP/upgrade.bin"; then
+	ok "download across the upgrade"
+    else
+	notok "download across the upgrade"
+    fi
+fi
+
+# rate limits: exempt ranges must parse, and exempt
+refuses -a 10.0.0.0/8x
+refuses -a 10.0.0.0/33
+refuses -a 10.0.0.0/-1
+refuses -a /8
+refuses -r x
+refuses -b 1q
+if serve rate -r 1:2 "$TMP/www"; then
+    codes=$(for i in 1 2 3 4 5; do status "$URL/s.css"; echo; done)
+    case "$codes" in
+    *429*) ok "rate limit" ;;
+    *) notok "rate limit ($codes)" ;;
+    esac
+fi
+if serve exempt -r 1:2 -a 127.0.0.0/8 "$TMP/www"; then
+    codes=$(for i in 1 2 3 4 5; do status "$URL/s.css"; echo; done)
+    case "$codes" in
+    *429*) notok "exempt range ($codes)" ;;
+    *) ok "exempt range" ;;
+    esac
+fi
+
+# listeners: every -p is served, socket options are parsed
+refuses -o backlog=x
+refuses -o rcvbuf=1q
+second=$((PORT + 2))
+if serve listen -p "$second" -o backlog=16,rcvbuf=64k,sndbuf=64k,defer=1 \
+    "$TMP/www"; then
+    expect 200 "$(status "$URL/s.css")" "first port"
+    expect 200 "$(status "http://127.0.0.1:$second/s.css")" "second port"
+fi
+PORT=$second
+
+# tracing: every phase of a sampled request lands in the dump
+refuses -o trace=x
+if serve trace -o "trace=1,tracefile=$TMP/trace.json" "$TMP/www"; then
+    curl -s -o /dev/null "$URL/s.css"
+    kill -USR1 "${pids[-1]}"
+    sleep 0.3
+    for phase in read parse resolve mime send; do
+	if grep -q "\"name\":\"$phase\"" "$TMP/trace.json" 2>/dev/null; then
+	    ok "trace has $phase"
+	else
+	    notok "trace has $phase"
+	fi
+    done
+fi
+
+# output of unknown length: chunked for HTTP/1.1, closed for HTTP/1.0
+printf '#!/bin/sh\nprintf "Content-Type: text/plain\\r\\n\\r\\n"\nseq 20000\n' \
+    > "$TMP/cgi/seq.sh"
+chmod +x "$TMP/cgi/seq.sh"
+seq 20000 > "$TMP/seq.want"
+if serve chunked -c "$TMP/cgi" "$TMP/www"; then
+    curl -s -D "$TMP/dir.hdr" "$URL/sub/" > "$TMP/dir.body"
+    if grep -qi '^Transfer-Encoding: chunked' "$TMP/dir.hdr" &&
+	grep -q 'a\.txt' "$TMP/dir.body"; then
+	ok "chunked directory index"
+    else
+	notok "chunked directory index"
+    fi
+    curl -s -D "$TMP/seq.hdr" "$URL/cgi-bin/seq.sh" > "$TMP/seq.body"
+    if grep -qi '^Transfer-Encoding: chunked' "$TMP/seq.hdr" &&
+	cmp -s "$TMP/seq.want" "$TMP/seq.body"; then
+	ok "chunked CGI output"
+    else
+	notok "chunked CGI output"
+    fi
+    curl -s -0 -D "$TMP/seq10.hdr" "$URL/cgi-bin/seq.sh" > "$TMP/seq10.body"
+    if ! grep -qi '^Transfer-Encoding' "$TMP/seq10.hdr" &&
+	cmp -s "$TMP/seq.want" "$TMP/seq10.body"; then
+	ok "CGI output over HTTP/1.0"
+    else
+	notok "CGI output over HTTP/1.0"
+    fi
+    expect 200 "$(status -I "$URL/cgi-bin/seq.sh")" "HEAD on CGI"
+fi
+
+# packed docroots: the index builds for trees small and large, and hits
+# come back as they are on disk
+mkdir -p "$TMP/www/many"
+for i in $(seq 2000); do
+    echo "$i" > "$TMP/www/many/f$i.txt"
+done
+gzip -k "$TMP/www/s.css"
+mkdir -p "$TMP/two" "$TMP/four/sub"
+echo a > "$TMP/two/a"
+echo e > "$TMP/two/e"
+echo s > "$TMP/four/s.css"
+echo p > "$TMP/four/page.html"
+echo a > "$TMP/four/sub/a.txt"
+ln -s s.css "$TMP/four/link"
+for tree in two four www; do
+    if "$BIN/sws-pack" "$TMP/$tree" "$TMP/$tree.pack" > /dev/null 2>&1; then
+	ok "sws-pack $tree"
+    else
+	notok "sws-pack $tree"
+    fi
+done
+if serve packtwo -o "pack=$TMP/two.pack" "$TMP/two"; then
+    expect a "$(curl -s "$URL/a")" "pack of two, a"
+    expect e "$(curl -s "$URL/e")" "pack of two, e"
+fi
+echo late > "$TMP/www/late.txt"
+if serve pack -o "pack=$TMP/www.pack" "$TMP/www"; then
+    etag=$(curl -s -D - -o /dev/null "$URL/s.css" | tr -d '\r' |
+	sed -n 's/^ETag: //p')
+    case "$etag" in
+    \"*\") ok "pack ETag is quoted" ;;
+    *) notok "pack ETag is quoted (got '$etag')" ;;
+    esac
+    expect 304 "$(status -H "If-None-Match: $etag" "$URL/s.css")" \
+	"pack If-None-Match"
+    curl -s -H 'Accept-Encoding: gzip' "$URL/s.css" > "$TMP/s.css.gz"
+    if cmp -s "$TMP/www/s.css.gz" "$TMP/s.css.gz"; then
+	ok "pack gzip variant"
+    else
+	notok "pack gzip variant"
+    fi
+    curl -s --max-time 5 "$URL/big.bin" > "$TMP/packbig.bin"
+    if cmp -s "$TMP/www/big.bin" "$TMP/packbig.bin"; then
+	ok "pack big file"
+    else
+	notok "pack big file"
+    fi
+    expect 1234 "$(curl -s "$URL/many/f1234.txt")" "pack hit among many"
+    expect 404 "$(status "$URL/many/f2001.txt")" "pack miss"
+    expect 200 "$(status "$URL/inlink")" "pack relative symlink"
+    expect 403 "$(status "$URL/abslink")" "absolute symlink is not packed"
+    expect late "$(curl -s "$URL/late.txt")" "file added since packing"
+fi
+
+# replaying a log: statuses are compared, long gaps are slept through
+{
+    echo '# a note'
+    echo '::1 2026-10-18T20:33:06Z "GET /s.css HTTP/1.1" 200 21'
+    echo '::1 2026-10-18T20:33:06Z "GET /s.css HTTP/1.1" 304 0'
+    echo '::1 2026-10-18T20:33:07Z "GET /nope HTTP/1.1" 404 11'
+    echo '{"time": 0.5, "request": "GET /sub/a.txt HTTP/1.0", "status": 200}'
+    echo '{"time": 3000000, "request": "GET /s.css HTTP/1.0", "status": 200}'
+} > "$TMP/replay.log"
+if serve replay "$TMP/www"; then
+    "$BIN/sws-replay" -m -i 127.0.0.1 -p "$PORT" "$TMP/replay.log" \
+	> "$TMP/replay.report" 2>&1
+    if grep -q '^status: *5 as logged' "$TMP/replay.report"; then
+	ok "replay"
+    else
+	notok "replay ($(grep -A2 '^status' "$TMP/replay.report"))"
+    fi
+
+    if [ -r /proc/self/stat ]; then
+	"$BIN/sws-replay" -i 127.0.0.1 -p "$PORT" "$TMP/replay.log" \
+	    > /dev/null 2>&1 &
+	replay=$!
+	sleep 1.5
+	ticks=$(awk '{ print $14 + $15 }' "/proc/$replay/stat")
+	kill "$replay"
+	wait "$replay" 2>/dev/null
+	if [ "$ticks" -lt 20 ]; then
+	    ok "replay sleeps through a month-long gap"
+	else
+	    notok "replay sleeps through a month-long gap ($ticks ticks)"
+	fi
+    fi
+fi
+
+# early hints: HTML pages and CGI get them, other files do not
+echo '<html><link rel="stylesheet" href="/s.css"></html>' > "$TMP/www/page.html"
+mkdir -p "$TMP/www/private"
+cp "$TMP/www/page.html" "$TMP/www/private/page.html"
+{
+    echo '/cgi-bin/ /app.css style'
+    echo '/ /site.js script'
+    echo '/private/ off'
+} > "$TMP/hints"
+if serve hints -c "$TMP/cgi" -o "hints=1,hintfile=$TMP/hints" "$TMP/www"; then
+    curl -s -D "$TMP/page.hdr" -o /dev/null "$URL/page.html"
+    if grep -q '^HTTP/1.1 103' "$TMP/page.hdr" &&
+	grep -q '</s.css>; rel=preload' "$TMP/page.hdr" &&
+	grep -q '</site.js>; rel=preload' "$TMP/page.hdr"; then
+	ok "hints for a page"
+    else
+	notok "hints for a page"
+    fi
+    curl -s -D "$TMP/cgi.hdr" -o /dev/null "$URL/cgi-bin/t.sh"
+    if grep -q '</app.css>; rel=preload' "$TMP/cgi.hdr"; then
+	ok "hints for CGI"
+    else
+	notok "hints for CGI"
+    fi
+    if curl -s -D - -o /dev/null "$URL/s.css" | grep -qi '^Link:'; then
+	notok "no hints for a stylesheet"
+    else
+	ok "no hints for a stylesheet"
+    fi
+    if curl -s -D - -o /dev/null "$URL/private/page.html" |
+	grep -qi '^Link:'; then
+	notok "hints off by prefix"
+    else
+	ok "hints off by prefix"
+    fi
+fi
+
+# the path index: misses are rejected, ".." still gets 403, the index
+# follows the tree as it changes
+if serve index -o index=1 "$TMP/www"; then
+    expect 404 "$(status "$URL/nope")" "index rejects a missing file"
+    expect 404 "$(status "$URL/many/f2001.txt")" "missing file next to many"
+    expect 200 "$(status "$URL/many/f1999.txt")" "indexed file"
+    expect 200 "$(status "$URL/sub/")" "indexed directory"
+    expect 403 "$(status --path-as-is "$URL/nope/../s.css")" \
+	".. is forbidden even where the index has nothing"
+    if [ "$(uname -s)" = Linux ]; then
+	echo new > "$TMP/www/new.txt"
+	mkdir -p "$TMP/www/nd/x"
+	echo y > "$TMP/www/nd/x/y.txt"
+	sleep 0.5
+	expect 200 "$(status "$URL/new.txt")" "file added after startup"
+	expect 200 "$(status "$URL/nd/x/y.txt")" "directory added after startup"
+    fi
+    kill -USR1 "${pids[-1]}"
+    sleep 0.3
+    if grep -q '^# index: .* lookups rejected' "$TMP/index.out"; then
+	ok "index report"
+    else
+	notok "index report"
+    fi
+fi
+
+# worker limits: idle keep-alive connections make way once they are all
+# that is left, and a child killed while idle stops counting as idle
+refuses -o workers=0:2
+refuses -o workers=3:2
+refuses -o workers=2
+refuses -o workers=1:2x
+if serve workers -o workers=1:1 "$TMP/www"; then
+    exec 3<>"/dev/tcp/127.0.0.1/$PORT" 4<>"/dev/tcp/127.0.0.1/$PORT"
+    printf 'GET /s.css HTTP/1.1\r\nHost: x\r\n\r\n' >&3
+    sleep 0.3
+    printf 'GET /s.css HTTP/1.1\r\nHost: x\r\n\r\n' >&4
+    sleep 0.3
+    expect 200 "$(status "$URL/s.css")" "third connection past two idle ones"
+    exec 3>&- 4>&-
+
+    sleep 0.3
+    exec 3<>"/dev/tcp/127.0.0.1/$PORT"
+    printf 'GET /s.css HTTP/1.1\r\nHost: x\r\n\r\n' >&3
+    sleep 0.3
+    pkill -KILL -P "${pids[-1]}"
+    exec 3>&-
+    sleep 0.3
+    exec 4<>"/dev/tcp/127.0.0.1/$PORT"
+    printf 'GET /s.css HTTP/1.1\r\n' >&4
+    sleep 0.3
+    expect 000 "$(status --max-time 1 "$URL/s.css")" \
+	"one busy worker of one after an idle child was killed"
+    exec 4>&-
+    expect 200 "$(status "$URL/s.css")" "the worker is free again"
+fi
+
+# warming from the log: a query does not make a path of its own, notes
+# and lines that do not parse are skipped
+{
+    echo '::1 2026-10-18T20:33:06Z "GET /s.css?v=1 HTTP/1.1" 200 21'
+    echo '::1 2026-10-18T20:33:06Z "GET /s.css?v=2 HTTP/1.1" 200 21'
+    echo '::1 2026-10-18T20:33:06Z "GET /page.html HTTP/1.1" 200 51'
+    echo '# a note'
+    echo 'garbage'
+} > "$TMP/warm.log"
+if serve warm -l "$TMP/warm.log" -o warm=10 "$TMP/www"; then
+    if grep -q '^# warmed 2 of 2 paths' "$TMP/warm.out"; then
+	ok "warm"
+    else
+	notok "warm ($(grep warmed "$TMP/warm.out"))"
+    fi
+fi
+
+echo "$((run - fail)) of $run passed"
+[ "$fail" -eq 0 ]
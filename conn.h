@@ -0,0 +1,24 @@
+#ifndef _CONN_H_
+#define _CONN_H_
+
+#include <netinet/in.h>
+
+#include "arena.h"
+
+/*
+ * per-connection state.  Anything that only lives for one request is
+ * allocated from the arena, so this stays small while the connection
+ * is idle between keep-alive requests.
+ */
+struct connection {
+    unsigned long id;	/* assigned at accept, in order */
+    int fd;
+    struct sockaddr_in6 client;
+    struct arena arena;
+    char *in;		/* request bytes read but not yet handled, or NULL */
+    size_t inlen;
+    unsigned requests;	/* requests served on this connection */
+    size_t peak;	/* most arena memory any one request needed */
+};
+
+#endif
@@ -0,0 +1,657 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<sys/inotify.h>)
+#include <sys/inotify.h>
+#define USE_INOTIFY
+#endif
+
+#include "docindex.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/*
+ * a Bloom filter over every path under the docroot, in a shared mapping
+ * so that children see paths the parent adds after they were forked.
+ */
+struct bloom {
+    size_t size;	/* of the mapping */
+    uint64_t nbits;
+    unsigned long paths;	/* inserted since the last rebuild */
+    unsigned long capacity;	/* paths it was sized for */
+    unsigned long checked;	/* lookups, and how they went */
+    unsigned long rejected;
+    unsigned long falsepos;
+    uint64_t bits[];
+};
+
+/* "/dir/" prefixes we cannot vouch for: symlinked or unreadable dirs */
+struct bypass {
+    char *prefix[INDEXBYPASS];
+    int n;
+    int full;		/* too many of them, the index is off */
+};
+
+/*
+ * a walk of a tree into a filter, which may be spread over many calls:
+ * one open directory per level below the start.
+ */
+struct walk {
+    struct bloom *b;
+    struct bypass *bp;
+    int watch;		/* add inotify watches as it goes */
+    int depth;
+    DIR *dir[INDEXDEPTH];
+    size_t len[INDEXDEPTH];	/* of rel, for the directory at each level */
+    char rel[PATH_MAX];		/* relative to root, "" for the root */
+    unsigned long walked;
+};
+
+static struct bloom *bloom = NULL;
+static char *root = NULL;
+static struct bypass bypass;
+static int overflow = 0;	/* out of inotify watches, the index is off */
+static unsigned long stale = 0;	/* paths removed since the last rebuild */
+static unsigned long walked = 0;	/* paths found by the last rebuild */
+static time_t rebuilt = 0;
+static struct walk pending;	/* a rebuild under way, into newbypass */
+static struct bypass newbypass;
+static int rebuilding = 0;
+
+#ifdef USE_INOTIFY
+static int ifd = -1;
+static char **watched = NULL;	/* directory (relative to root) by wd */
+static int nwatched = 0;
+#endif
+
+static void
+hashes(const char *path, size_t len, uint64_t *h1, uint64_t *h2)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+	h = (h ^ (unsigned char)path[i]) * 0x100000001b3ULL;
+    }
+    *h1 = h;
+
+    /* a second, independent enough hash for double hashing */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    *h2 = h | 1;
+}
+
+static void
+add(struct bloom *b, const char *path, size_t len)
+{
+    uint64_t h1, h2;
+    int i;
+
+    hashes(path, len, &h1, &h2);
+    for (i = 0; i < BLOOMHASHES; i++) {
+	uint64_t bit = (h1 + i * h2) % b->nbits;
+
+	__atomic_fetch_or(&b->bits[bit / 64], 1ULL << (bit % 64), __ATOMIC_RELAXED);
+    }
+    b->paths++;
+}
+
+static int
+contains(const struct bloom *b, const char *path, size_t len)
+{
+    uint64_t h1, h2;
+    int i;
+
+    hashes(path, len, &h1, &h2);
+    for (i = 0; i < BLOOMHASHES; i++) {
+	uint64_t bit = (h1 + i * h2) % b->nbits;
+
+	if (!(__atomic_load_n(&b->bits[bit / 64], __ATOMIC_RELAXED) &
+	    (1ULL << (bit % 64)))) {
+	    return 0;
+	}
+    }
+
+    return 1;
+}
+
+static struct bloom *
+bloomNew(unsigned long capacity)
+{
+    struct bloom *b;
+    uint64_t nbits;
+    size_t size;
+
+    if (capacity < BLOOMMIN) {
+	capacity = BLOOMMIN;
+    }
+    nbits = ((uint64_t)capacity * BLOOMBITS + 63) & ~(uint64_t)63;
+    size = sizeof(*b) + nbits / 8;
+
+    b = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (b == MAP_FAILED) {
+	return NULL;
+    }
+    b->size = size;
+    b->nbits = nbits;
+    b->capacity = capacity;
+
+    return b;
+}
+
+/*
+ * adds rel ("" for the root, "sub", "sub/a.txt") the ways it can be asked
+ * for: "/sub/a.txt", and "/sub" and "/sub/" for a directory.
+ */
+static void
+addPath(struct bloom *b, const char *rel, int dir)
+{
+    char path[PATH_MAX];
+    int n;
+
+    n = snprintf(path, sizeof(path), "/%s", rel);
+    if (n < 0 || (size_t)n >= sizeof(path) - 1) {
+	return;
+    }
+    if (n > 1) {
+	add(b, path, n);
+    }
+    if (dir) {
+	if (n > 1) {
+	    path[n++] = '/';
+	}
+	add(b, path, n);
+    }
+}
+
+static void
+addBypass(struct bypass *bp, const char *rel)
+{
+    if (bp->n == INDEXBYPASS) {
+	bp->full = 1;
+	return;
+    }
+    if (asprintf(&bp->prefix[bp->n], "/%s/", rel) < 0) {
+	bp->full = 1;
+	return;
+    }
+    bp->n++;
+}
+
+static void
+freeBypass(struct bypass *bp)
+{
+    int i;
+
+    for (i = 0; i < bp->n; i++) {
+	free(bp->prefix[i]);
+    }
+    memset(bp, 0, sizeof(*bp));
+}
+
+#ifdef USE_INOTIFY
+static void
+watch(const char *rel)
+{
+    char path[PATH_MAX];
+    int wd;
+
+    (void)snprintf(path, sizeof(path), "%s/%s", root, rel);
+    if ((wd = inotify_add_watch(ifd, path, IN_CREATE | IN_MOVED_TO |
+	IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR | IN_DONT_FOLLOW)) < 0) {
+	overflow = 1; /* out of watches, cannot keep up any more */
+	return;
+    }
+
+    if (wd >= nwatched) {
+	int n = wd + 64;
+	char **w = realloc(watched, n * sizeof(*w));
+
+	if (!w) {
+	    overflow = 1;
+	    return;
+	}
+	memset(w + nwatched, 0, (n - nwatched) * sizeof(*w));
+	watched = w;
+	nwatched = n;
+    }
+    free(watched[wd]);
+    watched[wd] = strdup(rel);
+}
+
+/* drops every watch, to start over */
+static void
+unwatch(void)
+{
+    int i;
+
+    if (ifd >= 0) {
+	(void)close(ifd);
+	ifd = -1;
+    }
+    for (i = 0; i < nwatched; i++) {
+	free(watched[i]);
+	watched[i] = NULL;
+    }
+}
+#endif
+
+/*
+ * starts a walk of the tree below rel into b.  The directory itself is
+ * added even if it cannot be read; then the walk is over at once.
+ */
+static void
+walkStart(struct walk *w, struct bloom *b, struct bypass *bp, const char *rel,
+    int watchtoo)
+{
+    char path[PATH_MAX];
+    DIR *d = NULL;
+    int fd;
+
+    memset(w, 0, sizeof(*w));
+    w->b = b;
+    w->bp = bp;
+    w->watch = watchtoo;
+    (void)snprintf(w->rel, sizeof(w->rel), "%s", rel);
+
+    addPath(b, rel, 1);
+    w->walked++;
+    (void)snprintf(path, sizeof(path), "%s%s%s", root, *rel ? "/" : "", rel);
+    if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 ||
+	(d = fdopendir(fd)) == NULL) {
+	if (fd >= 0) {
+	    (void)close(fd);
+	}
+	return;
+    }
+#ifdef USE_INOTIFY
+    if (watchtoo) {
+	watch(rel);
+    }
+#endif
+    w->dir[0] = d;
+    w->len[0] = strlen(w->rel);
+    w->depth = 1;
+}
+
+/*
+ * adds name, in the directory dfd, whose path is w->rel.  Symlinks are
+ * not followed; one to a directory turns the index off below it, as does
+ * a directory we cannot go into.
+ */
+static void
+visit(struct walk *w, int dfd, const char *name)
+{
+    struct stat sb;
+    DIR *d = NULL;
+    int fd = -1;
+
+    if (fstatat(dfd, name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+	return;
+    }
+    w->walked++;
+
+    if (S_ISDIR(sb.st_mode)) {
+	addPath(w->b, w->rel, 1);
+	if (w->depth == INDEXDEPTH ||
+	    (fd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+	    O_CLOEXEC)) < 0 || (d = fdopendir(fd)) == NULL) {
+	    if (fd >= 0) {
+		(void)close(fd);
+	    }
+	    addBypass(w->bp, w->rel);
+	    return;
+	}
+#ifdef USE_INOTIFY
+	if (w->watch) {
+	    watch(w->rel);
+	}
+#endif
+	w->dir[w->depth] = d;
+	w->len[w->depth++] = strlen(w->rel);
+    } else if (S_ISLNK(sb.st_mode) && fstatat(dfd, name, &sb, 0) == 0 &&
+	S_ISDIR(sb.st_mode)) {
+	addPath(w->b, w->rel, 1);
+	addBypass(w->bp, w->rel);
+    } else {
+	addPath(w->b, w->rel, 0);
+    }
+}
+
+/*
+ * goes on with a walk for at most budget entries.
+ * return values:
+ *  1: there is more to do
+ *  0: the walk is over
+ */
+static int
+walkStep(struct walk *w, unsigned long budget)
+{
+    struct dirent *de;
+    size_t len;
+    DIR *d;
+    int n;
+
+    while (w->depth > 0 && budget-- > 0) {
+	d = w->dir[w->depth - 1];
+	if ((de = readdir(d)) == NULL) {
+	    (void)closedir(d);
+	    if (--w->depth > 0) {
+		w->rel[w->len[w->depth - 1]] = '\0';
+	    }
+	    continue;
+	}
+	if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+	    continue;
+	}
+
+	len = w->len[w->depth - 1];
+	n = snprintf(w->rel + len, sizeof(w->rel) - len, "%s%s",
+	    len ? "/" : "", de->d_name);
+	if (n > 0 && (size_t)n < sizeof(w->rel) - len) {
+	    visit(w, dirfd(d), de->d_name);
+	}
+	w->rel[w->len[w->depth - 1]] = '\0';
+    }
+
+    return w->depth > 0;
+}
+
+static void
+walkAbort(struct walk *w)
+{
+    while (w->depth > 0) {
+	(void)closedir(w->dir[--w->depth]);
+    }
+}
+
+/*
+ * starts building a new filter sized for what was there last time (twice
+ * that, so it can grow)
+ */
+static int
+rebuildStart(int watchtoo)
+{
+    struct bloom *b;
+
+    if ((b = bloomNew(walked * 2)) == NULL) {
+	return -1;
+    }
+    walkStart(&pending, b, &newbypass, "", watchtoo);
+    rebuilding = 1;
+
+    return 0;
+}
+
+/*
+ * puts the new filter in place.  Children forked earlier keep the old one.
+ */
+static void
+rebuildFinish(void)
+{
+    struct bloom *b = pending.b, *old = bloom;
+
+    if (old) {
+	b->checked = old->checked;
+	b->rejected = old->rejected;
+	b->falsepos = old->falsepos;
+    }
+    bloom = b;
+    if (old) {
+	(void)munmap(old, old->size);
+    }
+
+    freeBypass(&bypass);
+    bypass = newbypass;
+    memset(&newbypass, 0, sizeof(newbypass));
+    walked = pending.walked;
+    rebuilt = time(NULL);
+    rebuilding = 0;
+}
+
+/*
+ * rebuilds the filter in one go, and the inotify watches with it
+ */
+static int
+rebuild(void)
+{
+    if (rebuilding) {
+	walkAbort(&pending);
+	(void)munmap(pending.b, pending.b->size);
+	freeBypass(&newbypass);
+	rebuilding = 0;
+    }
+    overflow = 0;
+    stale = 0;
+
+#ifdef USE_INOTIFY
+    unwatch();
+    ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+
+    if (rebuildStart(1) < 0) {
+	return -1;
+    }
+    (void)walkStep(&pending, ULONG_MAX);
+    rebuildFinish();
+
+    return 0;
+}
+
+/*
+ * indexes the docroot.  Call this before forking; children inherit the
+ * filter and see what the parent adds to it later.
+ * return values:
+ *  -1: the filter could not be mapped
+ *  0: success
+ */
+int
+docIndexInit(const char *docroot)
+{
+    if ((root = realpath(docroot, NULL)) == NULL) {
+	return -1;
+    }
+
+    /* the first pass only finds out how big the tree is */
+    if (rebuild() < 0 || (bloom->paths > bloom->capacity && rebuild() < 0)) {
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * checks a decoded docroot path against the index.
+ * return values:
+ *  1: it may exist, look it up
+ *  0: it certainly does not
+ */
+int
+docIndexMaybe(const char *path)
+{
+    int i;
+
+    if (!bloom || overflow || bypass.full) {
+	return 1;
+    }
+
+    /* whatever the filesystem would make of these, it was not indexed */
+    if (strstr(path, "//") || strstr(path, "/./") ||
+	(strlen(path) >= 2 && strcmp(path + strlen(path) - 2, "/.") == 0)) {
+	return 1;
+    }
+    for (i = 0; i < bypass.n; i++) {
+	if (strncmp(path, bypass.prefix[i], strlen(bypass.prefix[i])) == 0) {
+	    return 1;
+	}
+    }
+
+    __atomic_fetch_add(&bloom->checked, 1, __ATOMIC_RELAXED);
+    if (contains(bloom, path, strlen(path))) {
+	return 1;
+    }
+    __atomic_fetch_add(&bloom->rejected, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/*
+ * records that a path the index let through did not exist after all
+ */
+void
+docIndexMiss(void)
+{
+    if (bloom) {
+	__atomic_fetch_add(&bloom->falsepos, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * returns the descriptor to select() on for changes, or -1
+ */
+int
+docIndexFd(void)
+{
+#ifdef USE_INOTIFY
+    return bloom ? ifd : -1;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * reads the pending change events.  New paths go straight into the
+ * filter; removed ones cannot be taken out of it, so once enough have
+ * gone, or the filter is full, it is rebuilt.
+ */
+void
+docIndexUpdate(void)
+{
+#ifdef USE_INOTIFY
+    char buf[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    char rel[PATH_MAX];
+    struct walk w;
+    ssize_t n;
+    char *p;
+
+    if (!bloom || ifd < 0) {
+	return;
+    }
+
+    while ((n = read(ifd, buf, sizeof(buf))) > 0) {
+	for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+	    ev = (const struct inotify_event *)p;
+
+	    if (ev->mask & IN_Q_OVERFLOW) {
+		(void)rebuild();
+		return;
+	    }
+	    if (ev->wd < 0 || ev->wd >= nwatched || !watched[ev->wd] ||
+		ev->len == 0) {
+		continue;
+	    }
+	    (void)snprintf(rel, sizeof(rel), "%s%s%s", watched[ev->wd],
+		*watched[ev->wd] ? "/" : "", ev->name);
+
+	    if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+		stale++;
+	    } else if (ev->mask & IN_ISDIR) {
+		/* it may have arrived with contents */
+		walkStart(&w, bloom, &bypass, rel, 1);
+		(void)walkStep(&w, ULONG_MAX);
+		walked += w.walked;
+	    } else {
+		struct stat sb;
+		char path[PATH_MAX];
+
+		int len = snprintf(path, sizeof(path), "%s/%s", root, rel);
+
+		if (len > 0 && (size_t)len < sizeof(path) && lstat(path, &sb) == 0 && S_ISLNK(sb.st_mode) &&
+		    stat(path, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+		    addPath(bloom, rel, 1);
+		    addBypass(&bypass, rel);
+		} else {
+		    addPath(bloom, rel, 0);
+		}
+	    }
+	}
+    }
+
+    if (stale > bloom->paths / 4 || bloom->paths > bloom->capacity) {
+	(void)rebuild();
+    }
+#endif
+}
+
+/*
+ * without change events, the index is rebuilt every INDEXREBUILD seconds.
+ * The walk is done INDEXSTEP entries per call, so that a big tree does not
+ * hold up accepting; the old filter serves until it is over.
+ * return values:
+ *  1: a rebuild is under way, call again soon
+ *  0: nothing to do for now
+ */
+int
+docIndexTick(time_t now)
+{
+    if (!bloom || docIndexFd() >= 0) {
+	return 0;
+    }
+
+    if (!rebuilding && now - rebuilt >= INDEXREBUILD && rebuildStart(0) < 0) {
+	rebuilt = now; /* no memory for it, try again later */
+    }
+    if (rebuilding && !walkStep(&pending, INDEXSTEP)) {
+	rebuildFinish();
+    }
+
+    return rebuilding;
+}
+
+/*
+ * writes a note on the index to fd, the log.  The expected false
+ * positive rate follows from the fill; the observed one is the share of
+ * lookups for missing paths that the filter let through.
+ */
+void
+docIndexReport(int fd)
+{
+    char line[256];
+    double expect;
+    int n;
+
+    if (!bloom || fd < 0) {
+	return;
+    }
+
+    expect = pow(1 - exp(-(double)BLOOMHASHES * bloom->paths / bloom->nbits),
+	BLOOMHASHES);
+    n = snprintf(line, sizeof(line), "# index: %lu paths, %zu bytes, "
+	"%.2f%% false positives expected, %lu of %lu lookups rejected, "
+	"%lu false positives (%.2f%%)%s\n",
+	bloom->paths, bloom->size, expect * 100, bloom->rejected, bloom->checked,
+	bloom->falsepos, bloom->rejected + bloom->falsepos ?
+	100.0 * bloom->falsepos / (bloom->rejected + bloom->falsepos) : 0,
+	overflow ? ", off" : "");
+    if (n > 0 && write(fd, line, n) < 0) {
+	perror("write");
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef _DOCINDEX_H_
+#define _DOCINDEX_H_
+
+#include <time.h>
+
+#ifndef BLOOMBITS
+#define BLOOMBITS 10 /* bits per path, ~1% false positives with BLOOMHASHES */
+#endif
+
+#ifndef BLOOMHASHES
+#define BLOOMHASHES 7
+#endif
+
+#ifndef BLOOMMIN
+#define BLOOMMIN 1024 /* paths sized for at least, so a small tree can grow */
+#endif
+
+#ifndef INDEXBYPASS
+#define INDEXBYPASS 64 /* symlinked directories, whose contents are not indexed */
+#endif
+
+#ifndef INDEXDEPTH
+#define INDEXDEPTH 32 /* directory levels indexed, deeper ones are bypassed */
+#endif
+
+#ifndef INDEXSTEP
+#define INDEXSTEP 4096 /* entries walked per turn of the main loop */
+#endif
+
+#ifndef INDEXREBUILD
+#define INDEXREBUILD 60 /* seconds between rebuilds without inotify */
+#endif
+
+int docIndexInit(const char *);
+int docIndexMaybe(const char *);
+void docIndexMiss(void);
+int docIndexFd(void);
+void docIndexUpdate(void);
+int docIndexTick(time_t);
+void docIndexReport(int);
+
+#endif
@@ -0,0 +1,453 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fsio.h"
+
+/*
+ * io_uring is only used when the kernel headers are around at build time;
+ * everything else (NetBSD, OmniOS, old Linux) gets the plain syscalls.
+ * liburing is not required, the ring is driven with raw syscalls.  It is
+ * only worth its setup where ops overlap: sending a big file, the read of
+ * the next chunk in flight with the send of this one.  Opens, stats, reads
+ * and closes are left to the plain syscalls by the callers, a
+ * submit-and-wait on a ring would only add a syscall to each.
+ */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define USE_IO_URING 1
+#endif
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/openat2.h>)
+#define USE_OPENAT2 1
+#endif
+#endif
+
+#if defined(USE_IO_URING) || defined(USE_OPENAT2)
+#include <sys/syscall.h>
+#endif
+
+#ifdef USE_OPENAT2
+#include <linux/openat2.h>
+#endif
+
+#ifdef USE_IO_URING
+#include <sys/mman.h>
+
+#include <linux/io_uring.h>
+
+struct ring {
+    int fd;
+    void *sq_ptr, *cq_ptr, *sqes_ptr;	/* the mappings, for ringFree() */
+    size_t sq_sz, cq_sz, sqes_sz;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+};
+
+/*
+ * available is decided once by fsioProbe() in the parent.  The ring itself
+ * is created lazily by whichever process first needs it: a ring's memory is
+ * shared, so one inherited across fork() would be driven by every child at
+ * once.
+ */
+static int available = 0;
+static pid_t ring_owner = 0;
+static struct ring ring;
+
+/*
+ * unmaps and closes a ring.  Entries queued but not yet submitted are
+ * dropped with it, so they can never run later.
+ */
+static void
+ringFree(struct ring *r)
+{
+    if (r->sqes_ptr) {
+	(void)munmap(r->sqes_ptr, r->sqes_sz);
+    }
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr) {
+	(void)munmap(r->cq_ptr, r->cq_sz);
+    }
+    if (r->sq_ptr) {
+	(void)munmap(r->sq_ptr, r->sq_sz);
+    }
+    (void)close(r->fd);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+static int
+ringSetup(struct ring *r)
+{
+    struct io_uring_params p;
+    size_t sq_sz, cq_sz;
+    char *sq_ptr, *cq_ptr;
+    void *sqes;
+
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    if ((r->fd = (int)syscall(__NR_io_uring_setup, FSIO_ENTRIES, &p)) < 0) {
+	return -1;
+    }
+
+    sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_sz > sq_sz) {
+	sq_sz = cq_sz;
+    }
+
+    sq_ptr = mmap(NULL, sq_sz, PROT_READ | PROT_WRITE,
+	MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+	ringFree(r);
+	return -1;
+    }
+    r->sq_ptr = sq_ptr;
+    r->sq_sz = sq_sz;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	cq_ptr = sq_ptr;
+    } else {
+	cq_ptr = mmap(NULL, cq_sz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	if (cq_ptr == MAP_FAILED) {
+	    ringFree(r);
+	    return -1;
+	}
+    }
+    r->cq_ptr = cq_ptr;
+    r->cq_sz = cq_sz;
+
+    sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+	PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+	IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+	ringFree(r);
+	return -1;
+    }
+    r->sqes_ptr = sqes;
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    r->sq_head = (unsigned *)(sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+    r->sqes = sqes;
+
+    return 0;
+}
+
+/*
+ * returns the ring for the calling process, creating it on first use.
+ * return values:
+ *  NULL: io_uring is not usable, caller falls back to plain syscalls
+ */
+static struct ring *
+ringGet(void)
+{
+    if (!available) {
+	return NULL;
+    }
+
+    if (ring_owner != getpid()) {
+	if (ringSetup(&ring) < 0) {
+	    available = 0;
+	    return NULL;
+	}
+	ring_owner = getpid();
+    }
+
+    return &ring;
+}
+
+static struct io_uring_sqe *
+ringSqe(struct ring *r, unsigned long long data)
+{
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = data;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    return sqe;
+}
+
+/*
+ * submits the n entries queued with ringSqe() and waits for all of them
+ * to complete.  res[] is indexed by the user_data given to ringSqe().  On
+ * failure the ring is torn down and not used again by this process, so
+ * nothing still queued in it can run later.
+ * return values:
+ *  -2: the entries were submitted but their results are lost; they may
+ *      have run, so the caller must not do them again
+ *  -1: nothing was submitted, the caller may do the ops itself
+ *  0: every result is in res[]
+ */
+static int
+ringWait(struct ring *r, unsigned n, int *res)
+{
+    unsigned done = 0, submit = n;
+    long ret;
+
+    while (done < n) {
+	if ((ret = syscall(__NR_io_uring_enter, r->fd, submit, n - done,
+	    IORING_ENTER_GETEVENTS, NULL, 0)) < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    ringFree(r);
+	    available = 0;
+	    return submit == n ? -1 : -2;
+	}
+	submit -= (unsigned)ret < submit ? (unsigned)ret : submit;
+
+	unsigned head = *r->cq_head;
+	while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+	    struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+	    res[cqe->user_data] = cqe->res;
+	    head++;
+	    done++;
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+static int
+ringResult(int res)
+{
+    if (res < 0) {
+	errno = -res;
+	return -1;
+    }
+    return res;
+}
+#endif /* USE_IO_URING */
+
+/*
+ * checks at runtime whether io_uring can be used for every op we need.
+ * seccomp filters and io_uring_disabled make it fail even on new kernels.
+ * return values:
+ *  1: io_uring will be used
+ *  0: plain blocking syscalls will be used
+ */
+int
+fsioProbe(void)
+{
+#ifdef USE_IO_URING
+    const int needed[] = { IORING_OP_READ, IORING_OP_SEND };
+    size_t len = sizeof(struct io_uring_probe) +
+	256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe;
+    struct ring r;
+    size_t i;
+
+    available = 0;
+    if (ringSetup(&r) < 0) {
+	return 0;
+    }
+
+    if ((probe = calloc(1, len)) == NULL) {
+	ringFree(&r);
+	return 0;
+    }
+
+    if (syscall(__NR_io_uring_register, r.fd, IORING_REGISTER_PROBE,
+	probe, 256) == 0) {
+	available = 1;
+	for (i = 0; i < sizeof(needed) / sizeof(needed[0]); i++) {
+	    if (needed[i] > probe->last_op ||
+		!(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+		available = 0;
+	    }
+	}
+    }
+
+    free(probe);
+    ringFree(&r);
+    return available;
+#else
+    return 0;
+#endif
+}
+
+const char *
+fsioBackend(void)
+{
+#ifdef USE_IO_URING
+    if (available) {
+	return "io_uring";
+    }
+#endif
+    return "sync";
+}
+
+/*
+ * opens path relative to dirfd, letting the kernel refuse any resolution
+ * that would leave dirfd (through "..", absolute symlinks or procfs magic
+ * links).
+ * return values:
+ *  -1: errno is set; EXDEV or ELOOP means path tried to escape, ENOSYS
+ *      means the kernel cannot do this and the caller has to check itself
+ *  >=0: the file descriptor
+ */
+int
+fsioOpenBeneath(int dirfd, const char *path, int flags)
+{
+#ifdef USE_OPENAT2
+    struct open_how how;
+
+    memset(&how, 0, sizeof(how));
+    how.flags = flags | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+    return (int)syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+#else
+    (void)dirfd;
+    (void)path;
+    (void)flags;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/*
+ * sends all of buf, retrying short sends.
+ * return values:
+ *  -1: the socket failed
+ *  >=0: bytes sent, always len
+ */
+ssize_t
+fsioSend(int sock, const void *buf, size_t len)
+{
+    const char *p = buf;
+    size_t left = len;
+    ssize_t n;
+
+    while (left > 0) {
+	if ((n = send(sock, p, left, MSG_NOSIGNAL)) < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    return -1;
+	}
+	p += n;
+	left -= n;
+    }
+
+    return len;
+}
+
+/*
+ * copies len bytes of fd starting at off to the socket.
+ * with io_uring the read of the next chunk is in flight while the
+ * current one is being sent, so disk latency overlaps the network.
+ * without it, the kernel is asked to read ahead of us instead.
+ * return values:
+ *  -1: reading the file or writing the socket failed
+ *  >=0: bytes sent
+ */
+ssize_t
+fsioSendFile(int sock, int fd, off_t off, size_t len)
+{
+    static char buf[2][FSIO_CHUNK];
+    size_t sent = 0;
+    ssize_t n = 0;
+    int cur = 0;
+
+#ifdef USE_IO_URING
+    struct ring *r;
+    int rc;
+
+    /* a ring costs a setup and three mappings, only big files repay that */
+    if (len >= FSIO_RINGMIN && (r = ringGet()) != NULL) {
+	if ((n = pread(fd, buf[cur], FSIO_CHUNK, off)) < 0) {
+	    return -1;
+	}
+
+	while (n > 0 && sent < len) {
+	    struct io_uring_sqe *sqe;
+	    size_t have = (size_t)n;
+	    int res[2];
+
+	    if (have > len - sent) {
+		have = len - sent;
+	    }
+
+	    sqe = ringSqe(r, 0);
+	    sqe->opcode = IORING_OP_SEND;
+	    sqe->fd = sock;
+	    sqe->addr = (unsigned long)buf[cur];
+	    sqe->len = have;
+	    sqe->msg_flags = MSG_NOSIGNAL;
+
+	    sqe = ringSqe(r, 1);
+	    sqe->opcode = IORING_OP_READ;
+	    sqe->fd = fd;
+	    sqe->addr = (unsigned long)buf[cur ^ 1];
+	    sqe->len = FSIO_CHUNK;
+	    sqe->off = off + sent + have;
+
+	    if ((rc = ringWait(r, 2, res)) == -1) {
+		goto sync; /* neither ran, carry on without the ring */
+	    } else if (rc < 0) {
+		return -1;
+	    }
+	    if (ringResult(res[0]) < 0) {
+		return -1;
+	    }
+	    if ((size_t)res[0] < have && fsioSend(sock, buf[cur] + res[0],
+		have - res[0]) < 0) {
+		return -1;
+	    }
+	    sent += have;
+
+	    if ((n = ringResult(res[1])) < 0) {
+		return -1;
+	    }
+	    cur ^= 1;
+	}
+
+	return sent;
+    }
+sync:
+#endif
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    (void)posix_fadvise(fd, off, len, POSIX_FADV_SEQUENTIAL);
+    (void)posix_fadvise(fd, off, len, POSIX_FADV_WILLNEED);
+#endif
+    while (sent < len && (n = pread(fd, buf[cur], FSIO_CHUNK, off + sent)) > 0) {
+	if ((size_t)n > len - sent) {
+	    n = len - sent;
+	}
+	if (fsioSend(sock, buf[cur], n) < 0) {
+	    return -1;
+	}
+	sent += n;
+    }
+    if (n < 0) {
+	return -1;
+    }
+
+    return sent;
+}
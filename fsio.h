@@ -0,0 +1,24 @@
+#ifndef _FSIO_H_
+#define _FSIO_H_
+
+#include <sys/types.h>
+
+#ifndef FSIO_ENTRIES
+#define FSIO_ENTRIES 8 /* only a handful of ops are ever in flight */
+#endif
+
+#ifndef FSIO_RINGMIN
+#define FSIO_RINGMIN (4 * FSIO_CHUNK) /* smaller files are sent without the ring */
+#endif
+
+#ifndef FSIO_CHUNK
+#define FSIO_CHUNK 65536 /* size of each read/send in fsioSendFile */
+#endif
+
+int fsioProbe(void);
+const char *fsioBackend(void);
+int fsioOpenBeneath(int, const char *, int);
+ssize_t fsioSend(int, const void *, size_t);
+ssize_t fsioSendFile(int, int, off_t, size_t);
+
+#endif
@@ -0,0 +1,352 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "hints.h"
+#include "shlock.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+struct hintent {
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;	/* 0 if the slot is free */
+    char links[HINTSZ];	/* rendered Link headers, "" if the page has none */
+};
+
+/* lives in a shared mapping so a page is only scanned by the first child */
+struct hintcache {
+    struct shlock lock;
+    struct hintent ent[HINTSLOTS];
+};
+
+/*
+ * a line of the hints file: requests under prefix get link, or no hints
+ * at all if link is NULL ("off").
+ */
+struct rule {
+    char *prefix;
+    size_t len;
+    char *link;
+};
+
+static struct hintcache *cache = NULL;
+static struct rule rules[HINTRULES];
+static int nrules = 0;
+
+/*
+ * checks that url can go into a Link header as is, and that it points
+ * back at us: no scheme, no network path, nothing that ends the header.
+ */
+static int
+sameOrigin(const char *url, size_t len)
+{
+    size_t i;
+
+    if (len == 0 || (len > 1 && url[0] == '/' && url[1] == '/')) {
+	return 0;
+    }
+    for (i = 0; i < len; i++) {
+	unsigned char ch = url[i];
+
+	if (ch == ':' || ch == '<' || ch == '>' || ch == '"' || ch == '\'' ||
+	    isspace(ch) || iscntrl(ch)) {
+	    return 0;
+	}
+	if (ch == '/' || ch == '?' || ch == '#') {
+	    break; /* a ':' further on is not a scheme */
+	}
+    }
+    for (; i < len; i++) {
+	unsigned char ch = url[i];
+
+	if (ch == '<' || ch == '>' || ch == '"' || isspace(ch) || iscntrl(ch)) {
+	    return 0;
+	}
+    }
+
+    return 1;
+}
+
+/*
+ * loads the per-path rules, one per line:
+ *	/prefix url as		e.g. "/docs/ /docs/site.css style"
+ *	/prefix off		no hints below /prefix
+ * '#' starts a comment.
+ * return values:
+ *  -1: the file cannot be read or has a bad line
+ *  0: success
+ */
+static int
+loadRules(const char *file)
+{
+    char line[BUFSIZ], *prefix, *url, *as, *last;
+    FILE *fp;
+    int n = 0;
+
+    if ((fp = fopen(file, "r")) == NULL) {
+	return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+	struct rule *r;
+
+	n++;
+	if ((prefix = strtok_r(line, " \t\r\n", &last)) == NULL || *prefix == '#') {
+	    continue;
+	}
+	url = strtok_r(NULL, " \t\r\n", &last);
+	as = strtok_r(NULL, " \t\r\n", &last);
+
+	if (*prefix != '/' || !url || nrules == HINTRULES) {
+	    goto bad;
+	}
+	r = &rules[nrules];
+	if ((r->prefix = strdup(prefix)) == NULL) {
+	    goto bad;
+	}
+	r->len = strlen(prefix);
+	r->link = NULL;
+	if (strcmp(url, "off") != 0) {
+	    if (!sameOrigin(url, strlen(url)) || (as && !sameOrigin(as, strlen(as))) ||
+		asprintf(&r->link, "Link: <%s>; rel=preload%s%s\r\n", url,
+		as ? "; as=" : "", as ? as : "") < 0) {
+		goto bad;
+	    }
+	}
+	nrules++;
+    }
+
+    (void)fclose(fp);
+    return 0;
+
+bad:
+    (void)fprintf(stderr, "sws: %s:%d: bad hint\n", file, n);
+    (void)fclose(fp);
+    errno = EINVAL;
+    return -1;
+}
+
+/*
+ * turns on scanning of HTML pages and loads the per-path rules; either
+ * may be off.  Call this before forking.
+ * return values:
+ *  -1: the cache could not be mapped or the rules not loaded
+ *  0: success
+ */
+int
+hintsInit(int scan, const char *file)
+{
+    if (file && loadRules(file) < 0) {
+	return -1;
+    }
+
+    if (scan) {
+	cache = mmap(NULL, sizeof(*cache), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (cache == MAP_FAILED) {
+	    cache = NULL;
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * finds name="value" (or name=value) among the attributes in [p, end)
+ * return values:
+ *  NULL: not there
+ *  otherwise: the value, *len is its length
+ */
+static const char *
+attr(const char *p, const char *end, const char *name, size_t *len)
+{
+    size_t n = strlen(name);
+    const char *v;
+
+    for (; p + n < end; p++) {
+	if (!isspace((unsigned char)p[-1]) || strncasecmp(p, name, n) != 0 ||
+	    p[n] != '=') {
+	    continue;
+	}
+	v = p + n + 1;
+	if (v < end && (*v == '"' || *v == '\'')) {
+	    const char *q = memchr(v + 1, *v, end - v - 1);
+
+	    if (!q) {
+		return NULL;
+	    }
+	    *len = q - v - 1;
+	    return v + 1;
+	}
+	for (p = v; p < end && !isspace((unsigned char)*p) && *p != '>'; p++) {
+	    ;
+	}
+	*len = p - v;
+	return v;
+    }
+
+    return NULL;
+}
+
+static int
+hasWord(const char *p, size_t len, const char *word)
+{
+    size_t n = strlen(word), i;
+
+    for (i = 0; i + n <= len; i++) {
+	if (strncasecmp(p + i, word, n) == 0 &&
+	    (i == 0 || isspace((unsigned char)p[i - 1])) &&
+	    (i + n == len || isspace((unsigned char)p[i + n]))) {
+	    return 1;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * collects the stylesheets, scripts and images a page refers to and
+ * renders them as Link headers into out.
+ */
+static void
+scan(const char *buf, size_t len, char *out, size_t size)
+{
+    const char *p = buf, *end = buf + len, *tag, *close, *url, *rel, *as;
+    size_t used = 0, ulen, rlen, alen;
+    int found = 0, n;
+
+    out[0] = '\0';
+    while (found < HINTMAX && (p = memchr(p, '<', end - p)) != NULL) {
+	tag = ++p;
+	if ((close = memchr(tag, '>', end - tag)) == NULL) {
+	    break;
+	}
+	url = NULL;
+	as = NULL;
+	alen = 0;
+
+	if (strncasecmp(tag, "link", 4) == 0 && isspace((unsigned char)tag[4])) {
+	    if ((rel = attr(tag + 5, close, "rel", &rlen)) == NULL) {
+		continue;
+	    }
+	    if (hasWord(rel, rlen, "stylesheet")) {
+		as = "style";
+		alen = 5;
+	    } else if (!hasWord(rel, rlen, "preload") ||
+		(as = attr(tag + 5, close, "as", &alen)) == NULL) {
+		continue;
+	    }
+	    url = attr(tag + 5, close, "href", &ulen);
+	} else if (strncasecmp(tag, "script", 6) == 0 && isspace((unsigned char)tag[6])) {
+	    url = attr(tag + 7, close, "src", &ulen);
+	    as = "script";
+	    alen = 6;
+	} else if (strncasecmp(tag, "img", 3) == 0 && isspace((unsigned char)tag[3])) {
+	    url = attr(tag + 4, close, "src", &ulen);
+	    as = "image";
+	    alen = 5;
+	}
+
+	if (!url || !sameOrigin(url, ulen) || !sameOrigin(as, alen)) {
+	    continue;
+	}
+	n = snprintf(out + used, size - used, "Link: <%.*s>; rel=preload; as=%.*s\r\n",
+	    (int)ulen, url, (int)alen, as);
+	if (n < 0 || (size_t)n >= size - used) {
+	    out[used] = '\0';
+	    break;
+	}
+	used += n;
+	found++;
+	p = close + 1;
+    }
+}
+
+/*
+ * returns the Link headers for the page open on fd, scanning it only if
+ * this (inode, mtime) has not been seen before.
+ */
+static char *
+pageLinks(int fd, const struct stat *sb, struct arena *arena)
+{
+    struct hintent *e;
+    char *links, *buf;
+    ssize_t n;
+
+    e = &cache->ent[(sb->st_ino ^ (sb->st_dev << 7)) % HINTSLOTS];
+    shlockAcquire(&cache->lock);
+    if (e->mtime == sb->st_mtime && e->ino == sb->st_ino && e->dev == sb->st_dev) {
+	links = arenaStrndup(arena, e->links, strlen(e->links));
+	shlockRelease(&cache->lock);
+	return links;
+    }
+    shlockRelease(&cache->lock);
+
+    /* read by offset, so whoever sends the file next is not disturbed */
+    if ((buf = arenaAlloc(arena, HINTSCAN)) == NULL ||
+	(links = arenaAlloc(arena, HINTSZ)) == NULL ||
+	(n = pread(fd, buf, HINTSCAN, 0)) < 0) {
+	return NULL;
+    }
+    scan(buf, n, links, HINTSZ);
+
+    shlockAcquire(&cache->lock);
+    e->dev = sb->st_dev;
+    e->ino = sb->st_ino;
+    e->mtime = sb->st_mtime;
+    memcpy(e->links, links, strlen(links) + 1);
+    shlockRelease(&cache->lock);
+
+    return links;
+}
+
+/*
+ * builds the Link headers for a response to path: those the hints file
+ * gives for it, then those found in the page open on fd (-1 if there is
+ * no page to scan, e.g. for CGI).
+ * return values:
+ *  NULL: nothing to hint
+ *  otherwise: one or more "Link: ...\r\n" lines, allocated from arena
+ */
+const char *
+hintsFor(const char *path, int fd, const struct stat *sb, struct arena *arena)
+{
+    const char *page = "", *links = "";
+    int i;
+
+    for (i = 0; i < nrules; i++) {
+	if (strncmp(path, rules[i].prefix, rules[i].len) != 0) {
+	    continue;
+	}
+	if (!rules[i].link) {
+	    return NULL;
+	}
+	if ((links = arenaPrintf(arena, "%s%s", links, rules[i].link)) == NULL) {
+	    return NULL;
+	}
+    }
+
+    if (cache && fd >= 0 && (page = pageLinks(fd, sb, arena)) == NULL) {
+	page = "";
+    }
+
+    if (*links == '\0' && *page == '\0') {
+	return NULL;
+    }
+
+    return arenaPrintf(arena, "%s%s", links, page);
+}
@@ -0,0 +1,32 @@
+#ifndef _HINTS_H_
+#define _HINTS_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "arena.h"
+
+#ifndef HINTSLOTS
+#define HINTSLOTS 256 /* scanned pages remembered, shared by all children */
+#endif
+
+#ifndef HINTSZ
+#define HINTSZ 1024 /* rendered Link headers kept per page */
+#endif
+
+#ifndef HINTMAX
+#define HINTMAX 8 /* subresources hinted per page */
+#endif
+
+#ifndef HINTSCAN
+#define HINTSCAN 16384 /* how much of a page is scanned, hints belong in <head> */
+#endif
+
+#ifndef HINTRULES
+#define HINTRULES 64 /* per-path rules in the hints file */
+#endif
+
+int hintsInit(int, const char *);
+const char *hintsFor(const char *, int, const struct stat *, struct arena *);
+
+#endif
@@ -0,0 +1,175 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "listen.h"
+
+static void
+tune(int sock, const struct sockaddr *sa, const struct listenopts *o)
+{
+    int on = 1;
+
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+	perror("SO_REUSEADDR");
+    }
+
+#ifdef IPV6_V6ONLY
+    /* so that :: and 0.0.0.0 on the same port can both be bound */
+    if (sa->sa_family == AF_INET6 &&
+	setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on)) < 0) {
+	perror("IPV6_V6ONLY");
+    }
+#else
+    (void)sa;
+#endif
+
+    if (o->rcvbuf > 0 && setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &o->rcvbuf,
+	sizeof(o->rcvbuf)) < 0) {
+	perror("SO_RCVBUF");
+    }
+    if (o->sndbuf > 0 && setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &o->sndbuf,
+	sizeof(o->sndbuf)) < 0) {
+	perror("SO_SNDBUF");
+    }
+
+#ifdef TCP_DEFER_ACCEPT
+    /* don't wake us up until the request has arrived */
+    if (o->defer > 0 && setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+	&o->defer, sizeof(o->defer)) < 0) {
+	perror("TCP_DEFER_ACCEPT");
+    }
+#endif
+}
+
+/*
+ * set after listen(2), FreeBSD only accepts it on a listening socket
+ */
+static void
+tuneListening(int sock, const struct listenopts *o)
+{
+#ifdef TCP_FASTOPEN
+    if (o->fastopen > 0 && setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN,
+	&o->fastopen, sizeof(o->fastopen)) < 0) {
+	perror("TCP_FASTOPEN");
+    }
+#else
+    (void)sock;
+    (void)o;
+#endif
+}
+
+/*
+ * makes a listening socket non-blocking and close-on-exec, so accepts
+ * can be drained until EAGAIN and CGI scripts never inherit it.
+ * return values:
+ *  -1: fcntl failed
+ *  0: success
+ */
+int
+listenAdopt(int sock)
+{
+    int fl;
+
+    if ((fl = fcntl(sock, F_GETFL)) < 0 ||
+	fcntl(sock, F_SETFL, fl | O_NONBLOCK) < 0 ||
+	fcntl(sock, F_SETFD, FD_CLOEXEC) < 0) {
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * binds and listens on every address that address/port resolves to; with
+ * no address that is both the IPv4 and the IPv6 wildcard.  Sockets are
+ * appended to fds.
+ * return values:
+ *  -1: the address did not resolve
+ *  >=0: number of sockets added
+ */
+int
+listenOn(const char *address, const char *port, const struct listenopts *o,
+    int *fds, int max)
+{
+    struct addrinfo hints, *res, *p;
+    int n = 0, sock, err;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC; /* accept both ipv4 and ipv6 */
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE; /* wildcards */
+
+    if ((err = getaddrinfo(address, port, &hints, &res)) != 0) {
+	(void)fprintf(stderr, "sws: %s:%s: %s\n", address ? address : "*",
+	    port, gai_strerror(err));
+	return -1;
+    }
+
+    for (p = res; p != NULL && n < max; p = p->ai_next) {
+        if ((sock = socket(p->ai_family, SOCK_STREAM, 0)) == -1) {
+            continue;
+        }
+
+	tune(sock, p->ai_addr, o);
+
+        if (bind(sock, p->ai_addr, p->ai_addrlen) < 0) {
+	    perror("bind");
+	    close(sock);
+	    continue;
+        }
+	if (listen(sock, o->backlog > 0 ? o->backlog : MAXPENDING) < 0) {
+	    perror("listen");
+	    close(sock);
+	    continue;
+	}
+	if (listenAdopt(sock) < 0) {
+	    perror("fcntl");
+	    close(sock);
+	    continue;
+	}
+
+	tuneListening(sock, o);
+	fds[n++] = sock;
+    }
+
+    freeaddrinfo(res);
+    return n;
+}
+
+/*
+ * accepts one connection from a non-blocking listener.  The connection
+ * itself is blocking, it is served by a forked child.
+ * return values:
+ *  -1: nothing left to accept (EAGAIN) or an error, see errno
+ *  >=0: the connection
+ */
+int
+listenAccept(int sock, struct sockaddr_in6 *client)
+{
+    socklen_t length = sizeof(*client);
+    int fd;
+
+#ifdef SOCK_CLOEXEC
+    fd = accept4(sock, (struct sockaddr *)client, &length, SOCK_CLOEXEC);
+#else
+    if ((fd = accept(sock, (struct sockaddr *)client, &length)) >= 0) {
+	/* BSD accept(2) hands down the listener's O_NONBLOCK */
+	int fl = fcntl(fd, F_GETFL);
+	(void)fcntl(fd, F_SETFL, fl & ~O_NONBLOCK);
+	(void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+#endif
+
+    return fd;
+}
@@ -0,0 +1,27 @@
+#ifndef _LISTEN_H_
+#define _LISTEN_H_
+
+#include <netinet/in.h>
+
+#ifndef MAXPENDING
+#define MAXPENDING 128 /* default listen(2) backlog */
+#endif
+
+#ifndef ACCEPTBATCH
+#define ACCEPTBATCH 64 /* most connections taken from one listener per wake-up */
+#endif
+
+/* socket tuning, set with -o; 0 leaves the system default */
+struct listenopts {
+    int backlog;
+    int defer;		/* TCP_DEFER_ACCEPT seconds */
+    int fastopen;	/* TCP_FASTOPEN queue length */
+    int rcvbuf;
+    int sndbuf;
+};
+
+int listenOn(const char *, const char *, const struct listenopts *, int *, int);
+int listenAdopt(int);
+int listenAccept(int, struct sockaddr_in6 *);
+
+#endif
@@ -0,0 +1,192 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pack.h"
+
+static const char *map = NULL;	/* the whole archive, inherited by children */
+static const struct packhdr *hdr = NULL;
+static const int32_t *disp;
+static const struct packent *ents;
+
+/*
+ * FNV-1a with the basis replaced by d, so that every displacement gives
+ * an unrelated hash.  d == 0 picks the bucket.  The low k bits of FNV-1a
+ * depend only on the low k bits of each byte, so modulo a small or even
+ * count, paths differing higher up collide for every d; murmur3's
+ * finalizer spreads every input bit over the whole word first.
+ */
+uint32_t
+packHash(uint32_t d, const char *s, size_t len)
+{
+    size_t i;
+
+    if (d == 0) {
+	d = 0x811c9dc5;
+    }
+    for (i = 0; i < len; i++) {
+	d = (d ^ (unsigned char)s[i]) * 0x01000193;
+    }
+
+    d ^= d >> 16;
+    d *= 0x85ebca6b;
+    d ^= d >> 13;
+    d *= 0xc2b2ae35;
+    d ^= d >> 16;
+
+    return d;
+}
+
+/*
+ * maps an archive written by sws-pack.  Only the header is looked at, so
+ * this takes the same time whatever the number of files.
+ * return values:
+ *  -1: cannot be mapped or is not an archive, errno is set
+ *  0: success
+ */
+int
+packOpen(const char *path)
+{
+    const struct packhdr *h;
+    struct stat sb;
+    void *p;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+	return -1;
+    }
+    if (fstat(fd, &sb) < 0) {
+	(void)close(fd);
+	return -1;
+    }
+    if ((size_t)sb.st_size < sizeof(*h)) {
+	(void)close(fd);
+	errno = EINVAL;
+	return -1;
+    }
+
+    p = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    (void)close(fd);
+    if (p == MAP_FAILED) {
+	return -1;
+    }
+
+    h = p;
+    if (memcmp(h->magic, PACKMAGIC, sizeof(h->magic)) != 0 ||
+	h->size != (uint64_t)sb.st_size ||
+	h->disp + (uint64_t)h->nent * sizeof(int32_t) > h->size ||
+	h->ent + (uint64_t)h->nent * sizeof(struct packent) > h->size) {
+	(void)munmap(p, sb.st_size);
+	errno = EINVAL;
+	return -1;
+    }
+
+    map = p;
+    hdr = h;
+    disp = (const int32_t *)(map + hdr->disp);
+    ents = (const struct packent *)(map + hdr->ent);
+
+    return 0;
+}
+
+/*
+ * looks path up in the archive: two hashes and one compare.
+ * return values:
+ *  NULL: no archive, or path is not in it
+ *  otherwise: the entry
+ */
+const struct packent *
+packFind(const char *path)
+{
+    const struct packent *e;
+    size_t len;
+    uint32_t slot;
+    int32_t d;
+
+    if (!hdr || hdr->nent == 0) {
+	return NULL;
+    }
+
+    len = strlen(path);
+    d = disp[packHash(0, path, len) % hdr->nent];
+    if (d < 0) {
+	slot = (uint32_t)(-d - 1);
+    } else {
+	slot = packHash((uint32_t)d, path, len) % hdr->nent;
+    }
+    if (slot >= hdr->nent) {
+	return NULL;
+    }
+
+    e = &ents[slot];
+    if (e->urilen != len || e->uri + len >= hdr->size ||
+	memcmp(map + e->uri, path, len) != 0) {
+	return NULL;
+    }
+    if (e->nvar < 1 || e->nvar > 2) {
+	return NULL;
+    }
+
+    return e;
+}
+
+/*
+ * picks the gzip variant if the client takes it and there is one
+ */
+const struct packvar *
+packVariant(const struct packent *e, int gzip)
+{
+    const struct packvar *v = &e->var[gzip && e->nvar > 1];
+
+    if (v->body + v->bodylen > hdr->size || v->head + v->headlen > hdr->size ||
+	v->etag >= hdr->size) {
+	return NULL;
+    }
+
+    return v;
+}
+
+const char *
+packData(uint64_t off)
+{
+    return map + off;
+}
+
+/*
+ * decides a conditional request against v.  If-None-Match wins over
+ * If-Modified-Since when both are sent.
+ * return values:
+ *  1: the client's copy is current, answer 304
+ *  0: send the body
+ */
+int
+packNotModified(const struct packent *e, const struct packvar *v,
+    const struct request *req)
+{
+    const char *etag = map + v->etag;
+    size_t len = strlen(etag);
+
+    if (req->if_none_match.ptr) {
+	const char *p = req->if_none_match.ptr;
+	const char *end = p + req->if_none_match.len;
+
+	if (req->if_none_match.len == 1 && *p == '*') {
+	    return 1;
+	}
+	while (p + len <= end) {
+	    if (memcmp(p, etag, len) == 0) {
+		return 1;
+	    }
+	    p++;
+	}
+	return 0;
+    }
+
+    return req->ims_time > 0 && e->mtime <= req->ims_time;
+}
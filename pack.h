@@ -0,0 +1,59 @@
+#ifndef _PACK_H_
+#define _PACK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "request.h"
+
+#define PACKMAGIC "SWSPACK2" /* 1 hashed without the finalizer */
+
+#ifndef PACKALIGN
+#define PACKALIGN 4096 /* bodies at least this big start on a page */
+#endif
+
+/*
+ * one representation of a file.  head is everything from Server: to
+ * Content-Length:, so a response only needs its status line, Date and
+ * Connection prepended.
+ */
+struct packvar {
+    uint64_t head;	/* offset of the pre-rendered headers */
+    uint64_t body;	/* offset of the body */
+    uint64_t bodylen;
+    uint64_t etag;	/* offset of the NUL terminated, quoted ETag */
+    uint32_t headlen;
+    uint32_t pad;
+};
+
+struct packent {
+    uint64_t uri;	/* offset of the NUL terminated, decoded path */
+    int64_t mtime;
+    uint32_t urilen;
+    uint32_t nvar;	/* 1, or 2 if there is a gzip variant */
+    struct packvar var[2];	/* identity, gzip */
+};
+
+/*
+ * the archive is this header, nent int32_t displacements, nent entries
+ * in hash order, a string area and then the bodies.  Offsets are from
+ * the start of the file.
+ */
+struct packhdr {
+    char magic[8];
+    uint32_t nent;
+    uint32_t pad;
+    uint64_t disp;
+    uint64_t ent;
+    uint64_t size;	/* of the whole file, to catch truncation */
+};
+
+uint32_t packHash(uint32_t, const char *, size_t);
+int packOpen(const char *);
+const struct packent *packFind(const char *);
+const struct packvar *packVariant(const struct packent *, int);
+const char *packData(uint64_t);
+int packNotModified(const struct packent *, const struct packvar *,
+    const struct request *);
+
+#endif
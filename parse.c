@@ -51,9 +51,125 @@ validMethod(const char *method)
     return 0;
 }
 
+static int
+hexValue(int ch)
+{
+    if (ch >= '0' && ch <= '9') {
+	return ch - '0';
+    }
+    ch = tolower(ch);
+    if (ch >= 'a' && ch <= 'f') {
+	return ch - 'a' + 10;
+    }
+    return -1;
+}
+
+/*
+ * splits uri at the first '?' and percent-decodes the part before it.
+ * The query is left encoded, it is handed to CGI scripts as is.
+ * return values:
+ *  NULL: bad escape, an encoded NUL or out of memory
+ *  otherwise: the decoded path, allocated from arena
+ *
+ * for example:
+ *  uri = "/a%20b/c?x=%20"
+ *  => "/a b/c", query = "x=%20"
+ */
+char *
+decodeUri(struct slice uri, struct slice *query, struct arena *arena)
+{
+    const char *q = memchr(uri.ptr, '?', uri.len);
+    size_t len = q ? (size_t)(q - uri.ptr) : uri.len;
+    size_t i, j;
+    int hi, lo;
+    char *path;
+
+    query->ptr = q ? q + 1 : NULL;
+    query->len = q ? uri.len - len - 1 : 0;
+
+    if ((path = arenaAlloc(arena, len + 1)) == NULL) {
+	return NULL;
+    }
+
+    for (i = 0, j = 0; i < len; i++, j++) {
+	if (uri.ptr[i] != '%') {
+	    path[j] = uri.ptr[i];
+	    continue;
+	}
+
+	if (i + 2 >= len) {
+	    return NULL;
+	}
+	if ((hi = hexValue((unsigned char)uri.ptr[i + 1])) < 0 ||
+	    (lo = hexValue((unsigned char)uri.ptr[i + 2])) < 0 ||
+	    (hi == 0 && lo == 0)) {
+	    return NULL;
+	}
+	path[j] = (char)(hi << 4 | lo);
+	i += 2;
+    }
+    path[j] = '\0';
+
+    return path;
+}
+
+/*
+ * returns the next whitespace separated token in [*pp, end) and advances
+ * *pp past it.
+ */
+static struct slice
+nextToken(const char **pp, const char *end)
+{
+    struct slice tok;
+    const char *p = *pp;
+
+    while (p < end && isspace((unsigned char)*p)) {
+	p++;
+    }
+    tok.ptr = p;
+    while (p < end && !isspace((unsigned char)*p)) {
+	p++;
+    }
+    tok.len = p - tok.ptr;
+    *pp = p;
+
+    return tok;
+}
+
+/*
+ * checks whether the comma separated header value in [p, end) lists
+ * token, ignoring case.
+ * return values:
+ *  1: it does
+ *  0: it does not
+ */
+static int
+hasToken(const char *p, const char *end, const char *token)
+{
+    size_t len = strlen(token);
+
+    while (p < end) {
+	const char *q;
+
+	while (p < end && (isspace((unsigned char)*p) || *p == ',')) {
+	    p++;
+	}
+	for (q = p; q < end && *q != ',' && !isspace((unsigned char)*q); q++) {
+	    ;
+	}
+	if ((size_t)(q - p) == len && strncasecmp(p, token, len) == 0) {
+	    return 1;
+	}
+	p = q;
+    }
+
+    return 0;
+}
+
 /*
  * given the request requeststr, this function will parse it into the
- * according variables.
+ * according variables.  Nothing is copied: uri and the header values are
+ * slices into requeststr.  Only the decoded path is allocated, from arena.
  * return values:
  *  -1: invalid request
  *  0: successfully parsed request
@@ -66,43 +182,63 @@ validMethod(const char *method)
  *  => header = "Sat, 29 Oct 1994 19:43:31 GMT"
  */
 int
-parseRequest(const char *requeststr, struct request *req)
+parseRequest(const char *requeststr, struct request *req, struct arena *arena)
 {
     if (!requeststr || !req) {
         return -1;
     }
 
-    char line[BUFSIZ];
     const char *ptr = requeststr;
-    char *endCurrentLine;
+    const char *endCurrentLine;
+    struct slice tok;
+    char *end;
 
     endCurrentLine = strstr(ptr, "\r\n");
     if (!endCurrentLine) {
 	return -1;
     }
 
-    size_t len = endCurrentLine - ptr;
-    if (len >= sizeof(line)) {
-	len = sizeof(line) - 1;
+    req->line.ptr = ptr;
+    req->line.len = endCurrentLine - ptr;
+
+    tok = nextToken(&ptr, endCurrentLine);
+    if (tok.len == 0) {
+	return -1;
+    }
+    if (tok.len >= METHODSZ) {
+	req->method[0] = '\0'; /* longer than any we implement: a 501 */
+	return -1;
     }
+    memcpy(req->method, tok.ptr, tok.len);
+    req->method[tok.len] = '\0';
 
-    strncpy(line, ptr, len);
-    line[len] = '\0';
-    ptr = endCurrentLine + 2;
-    
-    int result;
-    if ((result = sscanf(line, "%s %s HTTP/%f",
-	req->method, req->uri, &(req->version))) != 3) {
+    req->uri = nextToken(&ptr, endCurrentLine);
+    tok = nextToken(&ptr, endCurrentLine);
+    if (req->uri.len == 0 || tok.len <= 5 || strncmp(tok.ptr, "HTTP/", 5) != 0) {
+	return -1;
+    }
+    req->version = strtof(tok.ptr + 5, &end);
+    if (end != tok.ptr + tok.len) {
 	return -1;
     }
+    ptr = endCurrentLine + 2;
 
     if (!validMethod(req->method)) {
         return -1;
     }
+
+    if ((req->path = decodeUri(req->uri, &req->query, arena)) == NULL) {
+	return -1;
+    }
     
-    /* downgrades communications to 1.0 */
+    /*
+     * downgrades communications to 1.0, except for how responses are
+     * framed and whether the connection stays open
+     */
+    req->http11 = 0;
     if (req->version > 1.099 && req->version < 1.101) {
 	req->version = 1.0;
+	req->http11 = 1;
     }
 
     if (req->version != 0.9 && req->version != 1.0 && req->version != 1.1) {
@@ -114,8 +250,13 @@ parseRequest(const char *requeststr, struct request *req)
         return -1;
     }
 
-    req->if_modified_since[0] = '\0';
+    req->if_modified_since.ptr = NULL;
+    req->if_modified_since.len = 0;
     req->ims_time = 0;
+    req->close = 0;
+    req->if_none_match.ptr = NULL;
+    req->if_none_match.len = 0;
+    req->gzip = 0;
 
     while (*ptr && strncmp(ptr, "\r\n", 2) != 0) {
 	endCurrentLine = strstr(ptr, "\r\n");
@@ -123,24 +264,39 @@ parseRequest(const char *requeststr, struct request *req)
 	    break;
 	}
 
-	len = endCurrentLine - ptr;
-	if (len >= sizeof(line)) {
-	    len = sizeof(line) - 1;
-	}
-
-    	strncpy(line, ptr, len);
-    	line[len] = '\0';
-   	ptr = endCurrentLine + 2;
+	if (strncasecmp(ptr, "If-Modified-Since:", 18) == 0) {
+	    const char *val = ptr + 18;
+	    char date[MAXDATESTR];
+	    size_t len;
 
-	if (strncasecmp(line, "If-Modified-Since:", 18) == 0) {
-	    const char * val = line + 18;
-      	    while (isspace((unsigned char)*val)) {
+      	    while (val < endCurrentLine && isspace((unsigned char)*val)) {
 		val++;
   	    }
-	    strncpy(req->if_modified_since, val, BUFSIZ-1);
-	    req->if_modified_since[BUFSIZ-1] = '\0';
-	    req->ims_time = parseDate(req->if_modified_since);
+	    req->if_modified_since.ptr = val;
+	    req->if_modified_since.len = endCurrentLine - val;
+
+	    len = req->if_modified_since.len;
+	    if (len >= sizeof(date)) {
+		len = sizeof(date) - 1;
+	    }
+	    memcpy(date, val, len);
+	    date[len] = '\0';
+	    req->ims_time = parseDate(date);
+	} else if (strncasecmp(ptr, "Connection:", 11) == 0) {
+	    req->close = hasToken(ptr + 11, endCurrentLine, "close");
+	} else if (strncasecmp(ptr, "If-None-Match:", 14) == 0) {
+	    const char *val = ptr + 14;
+
+	    while (val < endCurrentLine && isspace((unsigned char)*val)) {
+		val++;
+	    }
+	    req->if_none_match.ptr = val;
+	    req->if_none_match.len = endCurrentLine - val;
+	} else if (strncasecmp(ptr, "Accept-Encoding:", 16) == 0) {
+	    req->gzip = hasToken(ptr + 16, endCurrentLine, "gzip");
 	}
+
+   	ptr = endCurrentLine + 2;
     }
 
     return 0;
@@ -1,9 +1,15 @@
 #ifndef _PARSE_H_
 #define _PARSE_H_
 
+#include "arena.h"
 #include "request.h"
 
-int parseRequest(const char *, struct request *);
+#ifndef MAXDATESTR
+#define MAXDATESTR 64 /* longest If-Modified-Since value we bother parsing */
+#endif
+
+int parseRequest(const char *, struct request *, struct arena *);
+char *decodeUri(struct slice, struct slice *, struct arena *);
 int validMethod(const char *);
 time_t parseDate(const char *);
 
@@ -0,0 +1,293 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ratelimit.h"
+#include "shlock.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/*
+ * one client address.  Both buckets refill continuously: req at reqrate
+ * tokens per second up to burst, bw at bwrate bytes per second up to one
+ * second's worth.  bw may go negative, the debt is slept off.
+ */
+struct bucket {
+    struct in6_addr addr;
+    double seen;	/* last time this bucket was used, 0 if free */
+    double req;
+    double bw;
+};
+
+struct set {
+    struct shlock lock;
+    struct bucket b[RLWAYS];
+};
+
+struct cidr {
+    struct in6_addr net;
+    int prefix;
+};
+
+static double reqrate = 0, burst = 0, bwrate = 0;
+static struct set *table = NULL;	/* shared by all children */
+static struct cidr allow[RLALLOW];
+static int nallow = 0;
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * sets the limits and maps the bucket table.  A rate of 0 disables that
+ * limit; with both disabled nothing is mapped and every check is free.
+ * return values:
+ *  -1: the table could not be mapped
+ *  0: success
+ */
+int
+rateInit(double requests, double requestburst, double bytes)
+{
+    reqrate = requests;
+    burst = requestburst > 0 ? requestburst : requests;
+    bwrate = bytes;
+
+    if (reqrate <= 0 && bwrate <= 0) {
+	return 0;
+    }
+
+    table = mmap(NULL, RLSETS * sizeof(struct set), PROT_READ | PROT_WRITE,
+	MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED) {
+	table = NULL;
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * adds an address range that is never limited, e.g. "10.0.0.0/8" or
+ * "2001:db8::/32".  IPv4 ranges are stored v4-mapped, the way clients
+ * show up on a dual-stack socket.
+ * return values:
+ *  -1: not a valid range, or too many of them
+ *  0: success
+ */
+int
+rateAllow(const char *spec)
+{
+    char buf[INET6_ADDRSTRLEN];
+    const char *slash = strchr(spec, '/');
+    size_t len = slash ? (size_t)(slash - spec) : strlen(spec);
+    struct in_addr v4;
+    struct cidr *c;
+    int max;
+
+    if (nallow >= RLALLOW || len >= sizeof(buf)) {
+	return -1;
+    }
+    memcpy(buf, spec, len);
+    buf[len] = '\0';
+
+    c = &allow[nallow];
+    memset(c, 0, sizeof(*c));
+    if (inet_pton(AF_INET, buf, &v4) == 1) {
+	c->net.s6_addr[10] = 0xff;
+	c->net.s6_addr[11] = 0xff;
+	memcpy(&c->net.s6_addr[12], &v4, 4);
+	max = 32;
+    } else if (inet_pton(AF_INET6, buf, &c->net) == 1) {
+	max = 128;
+    } else {
+	return -1;
+    }
+
+    if (slash) {
+	char *end;
+	long prefix;
+
+	/* all of it digits: a typo must not become /0, exempting everyone */
+	errno = 0;
+	prefix = strtol(slash + 1, &end, 10);
+	if (!isdigit((unsigned char)slash[1]) || *end != '\0' || errno != 0 ||
+	    prefix > max) {
+	    return -1;
+	}
+	c->prefix = (int)prefix;
+    } else {
+	c->prefix = max;
+    }
+    c->prefix += 128 - max;
+
+    nallow++;
+    return 0;
+}
+
+static int
+exempt(const struct in6_addr *addr)
+{
+    int i, bits;
+
+    for (i = 0; i < nallow; i++) {
+	const unsigned char *a = addr->s6_addr, *n = allow[i].net.s6_addr;
+
+	for (bits = allow[i].prefix; bits >= 8; bits -= 8, a++, n++) {
+	    if (*a != *n) {
+		break;
+	    }
+	}
+	if (bits < 8 && (bits == 0 || ((*a ^ *n) & (0xff << (8 - bits))) == 0)) {
+	    return 1;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * returns 1 if response bodies should go through ratePace()
+ */
+int
+rateShaping(void)
+{
+    return table != NULL && bwrate > 0;
+}
+
+/*
+ * finds the bucket for addr and refills it up to t; call with the set
+ * locked.  A new client takes over the least recently used bucket.
+ */
+static struct bucket *
+find(struct set *s, const struct in6_addr *addr, double t)
+{
+    struct bucket *b, *victim = &s->b[0];
+    int i;
+
+    for (i = 0; i < RLWAYS; i++) {
+	b = &s->b[i];
+	if (b->seen > 0 && memcmp(&b->addr, addr, sizeof(*addr)) == 0) {
+	    b->req = fmin(burst, b->req + (t - b->seen) * reqrate);
+	    b->bw = fmin(bwrate, b->bw + (t - b->seen) * bwrate);
+	    b->seen = t;
+	    return b;
+	}
+	if (b->seen < victim->seen) {
+	    victim = b;
+	}
+    }
+
+    victim->addr = *addr;
+    victim->req = burst;
+    victim->bw = bwrate;
+    victim->seen = t;
+    return victim;
+}
+
+static struct set *
+setFor(const struct in6_addr *addr)
+{
+    unsigned h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < sizeof(addr->s6_addr); i++) {
+	h = (h ^ addr->s6_addr[i]) * 16777619u;
+    }
+
+    return &table[h % RLSETS];
+}
+
+/*
+ * takes one request token for addr.
+ * return values:
+ *  1: go ahead
+ *  0: over the limit, *retry is the number of seconds until a token is back
+ */
+int
+rateCheck(const struct in6_addr *addr, int *retry)
+{
+    struct set *s;
+    struct bucket *b;
+    int ok = 1;
+
+    if (!table || reqrate <= 0 || exempt(addr)) {
+	return 1;
+    }
+
+    s = setFor(addr);
+    shlockAcquire(&s->lock);
+    b = find(s, addr, now());
+    if (b->req >= 1) {
+	b->req -= 1;
+    } else {
+	ok = 0;
+	*retry = (int)ceil((1 - b->req) / reqrate);
+	if (*retry < 1) {
+	    *retry = 1;
+	}
+    }
+    shlockRelease(&s->lock);
+
+    return ok;
+}
+
+/*
+ * paces a response body for addr.  Returns how many of the want bytes
+ * may be sent now, after sleeping off whatever this client already owes.
+ * Workers sleep rather than spin, so a throttled client costs no CPU.
+ */
+size_t
+ratePace(const struct in6_addr *addr, size_t want)
+{
+    struct set *s;
+    struct bucket *b;
+    struct timespec ts;
+    double debt;
+    size_t slice;
+
+    if (!rateShaping() || exempt(addr)) {
+	return want;
+    }
+
+    slice = (size_t)(bwrate / RLSLICE);
+    if (slice < 1) {
+	slice = 1;
+    }
+    if (want > slice) {
+	want = slice;
+    }
+
+    s = setFor(addr);
+    shlockAcquire(&s->lock);
+    b = find(s, addr, now());
+    b->bw -= want;
+    debt = b->bw < 0 ? -b->bw / bwrate : 0;
+    shlockRelease(&s->lock);
+
+    if (debt > 0) {
+	ts.tv_sec = (time_t)debt;
+	ts.tv_nsec = (long)((debt - ts.tv_sec) * 1e9);
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+	    ;
+	}
+    }
+
+    return want;
+}
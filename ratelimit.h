@@ -0,0 +1,30 @@
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include <netinet/in.h>
+
+#include <stddef.h>
+
+#ifndef RLSETS
+#define RLSETS 1024 /* hash sets in the shared bucket table */
+#endif
+
+#ifndef RLWAYS
+#define RLWAYS 4 /* buckets per set; the least recently used one is recycled */
+#endif
+
+#ifndef RLALLOW
+#define RLALLOW 32 /* CIDR ranges that are never limited */
+#endif
+
+#ifndef RLSLICE
+#define RLSLICE 10 /* paced sends are cut so there are ~10 per second */
+#endif
+
+int rateInit(double, double, double);
+int rateAllow(const char *);
+int rateShaping(void);
+int rateCheck(const struct in6_addr *, int *);
+size_t ratePace(const struct in6_addr *, size_t);
+
+#endif
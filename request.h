@@ -1,19 +1,36 @@
 #ifndef _REQUEST_H_
 #define _REQUEST_H_
 
-#include <limits.h>
+#include <stddef.h>
 #include <time.h>
 
 #ifndef METHODSZ
 #define METHODSZ 5 /* enough for GET/HEAD + \0 */
 #endif
 
+/* a piece of the request buffer, not NUL terminated */
+struct slice {
+    const char *ptr;
+    size_t len;
+};
+
+/*
+ * everything but the method points into the buffer that was parsed, so
+ * the request is only valid as long as that buffer is.
+ */
 struct request {
     char method[METHODSZ];
-    char uri[PATH_MAX];
+    struct slice line;
+    struct slice uri;
+    char *path;		/* uri without the query, percent-decoded */
+    struct slice query;	/* what follows the '?', still encoded */
     float version;
-    char if_modified_since[BUFSIZ];
+    int http11;		/* sent as HTTP/1.1: may be kept alive and chunked */
+    int close;		/* Connection: close */
+    struct slice if_modified_since;
     time_t ims_time;
+    struct slice if_none_match;
+    int gzip;		/* Accept-Encoding lists gzip */
 };
 
 #endif
@@ -0,0 +1,285 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fsio.h"
+#include "resolve.h"
+#include "shlock.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+struct userent {
+    time_t expires;
+    int found;
+    char name[MAXUSERNAME];
+    char dir[USERDIRSZ];
+};
+
+/* lives in a shared mapping so every forked child sees every lookup */
+struct usercache {
+    struct shlock lock;
+    struct userent ent[USERCACHE];
+};
+
+/*
+ * a ~user/sws directory held open.  An fd cannot be handed between
+ * processes through the shared cache, so each process keeps its own.
+ */
+struct userbase {
+    time_t expires;
+    char name[MAXUSERNAME];
+    struct base b;
+};
+
+static struct base root = { -1, NULL };
+static struct base cgi = { -1, NULL };
+static struct usercache *users = NULL;
+static struct userbase userfds[USERFDS];
+static unsigned nextuserfd = 0;
+static int beneath = 1;
+
+static int
+openBase(const char *path, struct base *b)
+{
+    char *real;
+
+    if ((real = realpath(path, NULL)) == NULL) {
+	return -1;
+    }
+    if ((b->fd = open(real, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+	free(real);
+	return -1;
+    }
+    b->path = real; /* kept for the life of the process */
+
+    return 0;
+}
+
+/*
+ * opens the docroot and the CGI directory and keeps them open, so that
+ * every request is resolved relative to an fd instead of walking the
+ * full path again.  Call this before daemon() changes directory.
+ * return values:
+ *  -1: a directory could not be opened
+ *  0: success
+ */
+int
+resolverInit(const char *docroot, const char *cgidir)
+{
+    int fd;
+
+    if (openBase(docroot, &root) < 0) {
+	return -1;
+    }
+
+    if (cgidir && openBase(cgidir, &cgi) < 0) {
+	return -1;
+    }
+
+    if ((fd = fsioOpenBeneath(root.fd, ".", O_RDONLY | O_DIRECTORY)) < 0) {
+	beneath = 0; /* no openat2(2), do it the slow way */
+    } else {
+	(void)close(fd);
+    }
+
+    users = mmap(NULL, sizeof(*users), PROT_READ | PROT_WRITE,
+	MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (users == MAP_FAILED) {
+	users = NULL; /* no cache, every lookup goes to getpwnam */
+    }
+
+    return 0;
+}
+
+const struct base *
+resolverRoot(void)
+{
+    return &root;
+}
+
+const struct base *
+resolverCgi(void)
+{
+    return cgi.fd < 0 ? NULL : &cgi;
+}
+
+static struct userent *
+userSlot(const char *uname)
+{
+    unsigned h = 5381;
+    const char *p;
+
+    for (p = uname; *p; p++) {
+	h = h * 33 + (unsigned char)*p;
+    }
+
+    return &users->ent[h % USERCACHE];
+}
+
+/*
+ * looks up the home directory of uname, through the shared cache.
+ * misses are cached too: scanners ask for the same bogus users a lot.
+ * return values:
+ *  NULL: no such user
+ *  otherwise: the home directory, allocated from arena
+ */
+static char *
+userHome(const char *uname, struct arena *arena)
+{
+    struct userent *e = NULL;
+    struct passwd *pw;
+    time_t now = time(NULL);
+    char *home = NULL;
+    int cached = 0;
+
+    if (users) {
+	e = userSlot(uname);
+	shlockAcquire(&users->lock);
+	if (e->expires > now && strcmp(e->name, uname) == 0) {
+	    cached = 1;
+	    if (e->found) {
+		home = arenaStrndup(arena, e->dir, strlen(e->dir));
+	    }
+	}
+	shlockRelease(&users->lock);
+	if (cached) {
+	    return home;
+	}
+    }
+
+    if ((pw = getpwnam(uname)) != NULL) {
+	home = arenaStrndup(arena, pw->pw_dir, strlen(pw->pw_dir));
+    }
+
+    /*
+     * the slot is invalid while it is rewritten, so that if we die half
+     * way through, whoever takes the lock over does not trust it
+     */
+    if (e && (!home || strlen(home) < USERDIRSZ)) {
+	shlockAcquire(&users->lock);
+	__atomic_store_n(&e->expires, 0, __ATOMIC_RELEASE);
+	(void)snprintf(e->name, sizeof(e->name), "%s", uname);
+	(void)snprintf(e->dir, sizeof(e->dir), "%s", home ? home : "");
+	e->found = home != NULL;
+	__atomic_store_n(&e->expires, now + USERTTL, __ATOMIC_RELEASE);
+	shlockRelease(&users->lock);
+    }
+
+    return home;
+}
+
+/*
+ * finds ~uname/sws as a base to resolve beneath.  The directory is held
+ * open for USERTTL seconds like the docroot, so further requests for the
+ * same user on a kept connection do not walk its path again; the
+ * USERFDS least recently opened are closed to make room.  b->fd belongs
+ * to the cache, the caller must not close it.
+ * return values:
+ *  -1: no such user or no sws directory, errno is EACCES
+ *  0: success
+ */
+int
+userBase(const char *uname, struct base *b, struct arena *arena)
+{
+    struct userbase *u;
+    time_t now = time(NULL);
+    char *home, *path;
+    int i, fd;
+
+    for (i = 0; i < USERFDS; i++) {
+	u = &userfds[i];
+	if (u->expires > now && strcmp(u->name, uname) == 0) {
+	    *b = u->b;
+	    return 0;
+	}
+    }
+
+    if (strlen(uname) >= sizeof(userfds[0].name) ||
+	(home = userHome(uname, arena)) == NULL ||
+	(path = arenaPrintf(arena, "%s/sws", home)) == NULL ||
+	(fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+	errno = EACCES;
+	return -1;
+    }
+    if ((path = strdup(path)) == NULL) {
+	(void)close(fd);
+	return -1;
+    }
+
+    u = &userfds[nextuserfd++ % USERFDS];
+    if (u->expires) {
+	(void)close(u->b.fd);
+	free((char *)u->b.path);
+    }
+    (void)snprintf(u->name, sizeof(u->name), "%s", uname);
+    u->b.fd = fd;
+    u->b.path = path;
+    u->expires = now + USERTTL;
+    *b = u->b;
+
+    return 0;
+}
+
+/*
+ * opens rel beneath b.  With openat2(2) the kernel enforces that rel
+ * stays inside b; otherwise rel is resolved with realpath() and checked
+ * against b's real path.
+ * return values:
+ *  -1: errno is set, EACCES if rel tried to leave b
+ *  >=0: the file descriptor
+ */
+int
+resolveOpen(const struct base *b, const char *rel, int flags, struct arena *arena)
+{
+    char *candidate, *resolved, *real;
+    size_t len;
+    int fd;
+
+    if (*rel == '\0') {
+	rel = ".";
+    }
+
+    if (beneath) {
+	if ((fd = fsioOpenBeneath(b->fd, rel, flags)) < 0 &&
+	    (errno == EXDEV || errno == ELOOP)) {
+	    errno = EACCES;
+	}
+	return fd;
+    }
+
+    if ((candidate = arenaPrintf(arena, "%s/%s", b->path, rel)) == NULL ||
+	(resolved = arenaAlloc(arena, PATH_MAX)) == NULL) {
+	errno = ENOMEM;
+	return -1;
+    }
+
+    if (realpath(candidate, resolved) == NULL) {
+	return -1;
+    }
+
+    if ((real = realpath(b->path, NULL)) == NULL) {
+	return -1;
+    }
+    len = strlen(real);
+    if (strncmp(resolved, real, len) != 0 ||
+	(resolved[len] != '/' && resolved[len] != '\0')) {
+	free(real);
+	errno = EACCES;
+	return -1;
+    }
+    free(real);
+
+    return openat(AT_FDCWD, resolved, flags | O_CLOEXEC);
+}
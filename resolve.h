@@ -0,0 +1,44 @@
+#ifndef _RESOLVE_H_
+#define _RESOLVE_H_
+
+#include <time.h>
+
+#include "arena.h"
+
+#ifndef MAXUSERNAME
+#define MAXUSERNAME 256 /* 255 is classic UNIX username limit */
+#endif
+
+#ifndef USERDIRSZ
+#define USERDIRSZ 512 /* longer home directories are not cached */
+#endif
+
+#ifndef USERCACHE
+#define USERCACHE 64 /* passwd cache slots, shared by all children */
+#endif
+
+#ifndef USERTTL
+#define USERTTL 300 /* seconds a passwd lookup (or miss) is trusted */
+#endif
+
+#ifndef USERFDS
+#define USERFDS 8 /* ~user/sws directories a process keeps open */
+#endif
+
+/*
+ * a directory that requests are resolved beneath, held open by fd.
+ * path is only used to build CGI paths and when the kernel cannot
+ * resolve beneath fd itself.
+ */
+struct base {
+    int fd;
+    const char *path;
+};
+
+int resolverInit(const char *, const char *);
+const struct base *resolverRoot(void);
+const struct base *resolverCgi(void);
+int userBase(const char *, struct base *, struct arena *);
+int resolveOpen(const struct base *, const char *, int, struct arena *);
+
+#endif
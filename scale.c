@@ -0,0 +1,359 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "scale.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* filled in by the children */
+struct histogram {
+    uint64_t count[SCALEBUCKETS];	/* request latencies since the last tick */
+    int idle;	/* children waiting for the next request on a connection */
+    int shed;	/* set by the parent: idle children should hang up */
+    int nidlers;
+    pid_t idlers[];	/* which children count in idle, 0 for a free slot */
+};
+
+static struct histogram *hist = NULL;
+static int minworkers = 0;
+static int maxworkers = 0;
+static int limit = 0;		/* 0: no limit, one child per connection */
+static unsigned target = 0;	/* p99 in ms above which we do not grow */
+static int busyticks = 0;	/* consecutive ticks with connections waiting */
+static int idleticks = 0;	/* consecutive ticks with workers to spare */
+static uint64_t lasttick = 0;
+static int idleslot = -1;	/* in a child, its slot in idlers while idle */
+
+/*
+ * maps the latency histogram and sets the bounds on concurrent workers.
+ * The limit starts at min.  A p99 target in ms, if not 0, stops growth
+ * while requests are slower than that: more workers would only contend.
+ * return values:
+ *  -1: the histogram could not be mapped
+ *  0: success
+ */
+int
+scaleInit(int min, int max, unsigned p99)
+{
+    /* scaleAdmit() keeps the children to max * SCALEIDLE */
+    hist = mmap(NULL, sizeof(*hist) + max * SCALEIDLE * sizeof(pid_t),
+	PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (hist == MAP_FAILED) {
+	hist = NULL;
+	return -1;
+    }
+    hist->nidlers = max * SCALEIDLE;
+
+    minworkers = min;
+    maxworkers = max;
+    limit = min;
+    target = p99;
+
+    return 0;
+}
+
+/*
+ * returns how many connections may be served at once, 0 for no limit
+ */
+int
+scaleLimit(void)
+{
+    return limit;
+}
+
+/* of active children, those not between requests on a kept connection */
+static int
+busyOf(int active)
+{
+    int idle = __atomic_load_n(&hist->idle, __ATOMIC_RELAXED);
+
+    return idle < active ? active - idle : 0;
+}
+
+/*
+ * decides whether another connection may be accepted.  Children idle on
+ * a kept connection do not count against the limit, but all children
+ * together are held to SCALEIDLE times it; when that is what stops us,
+ * the idle ones are asked to hang up.
+ * return values:
+ *  1: accept
+ *  0: leave it in the accept queue
+ */
+int
+scaleAdmit(int active)
+{
+    int busy, admit;
+
+    if (!limit) {
+	return 1;
+    }
+
+    busy = busyOf(active);
+    admit = busy < limit && active < limit * SCALEIDLE;
+    __atomic_store_n(&hist->shed, busy < limit && !admit, __ATOMIC_RELAXED);
+
+    return admit;
+}
+
+/*
+ * empties slot i if it still holds pid; whoever empties it takes the
+ * child out of the idle count.
+ */
+static void
+unidle(int i, pid_t pid)
+{
+    if (__atomic_compare_exchange_n(&hist->idlers[i], &pid, 0, 0,
+	__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	__atomic_fetch_sub(&hist->idle, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * called by a child around its wait for the next request on a kept
+ * connection: 1 as it starts waiting, 0 when it stops.  The child is
+ * noted by pid so that scaleReap() can take it out should it die idle.
+ */
+void
+scaleIdle(int on)
+{
+    pid_t none;
+    int i;
+
+    if (!hist) {
+	return;
+    }
+
+    if (!on) {
+	if (idleslot >= 0) {
+	    unidle(idleslot, getpid());
+	    idleslot = -1;
+	}
+	return;
+    }
+
+    for (i = 0; i < hist->nidlers && idleslot < 0; i++) {
+	none = 0;
+	if (__atomic_compare_exchange_n(&hist->idlers[i], &none, getpid(), 0,
+	    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	    __atomic_fetch_add(&hist->idle, 1, __ATOMIC_RELAXED);
+	    idleslot = i;
+	}
+    }
+}
+
+/*
+ * called by the parent, from its SIGCHLD handler, for each child it
+ * reaps: one that exited while idle no longer counts as idle.
+ */
+void
+scaleReap(pid_t pid)
+{
+    int i;
+
+    if (!hist) {
+	return;
+    }
+
+    for (i = 0; i < hist->nidlers; i++) {
+	if (__atomic_load_n(&hist->idlers[i], __ATOMIC_RELAXED) == pid) {
+	    unidle(i, pid);
+	}
+    }
+}
+
+/*
+ * tells an idle child whether to give up its connection
+ */
+int
+scaleShed(void)
+{
+    return hist && __atomic_load_n(&hist->shed, __ATOMIC_RELAXED);
+}
+
+uint64_t
+scaleClock(void)
+{
+    struct timespec ts;
+
+    if (!hist) {
+	return 0;
+    }
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bucketOf(uint64_t us)
+{
+    int lg;
+
+    if (us < 4) {
+	return (int)us;
+    }
+    lg = 63 - __builtin_clzll(us);
+    if ((lg - 1) * 4 + 3 >= SCALEBUCKETS) {
+	return SCALEBUCKETS - 1;
+    }
+    return (lg - 1) * 4 + (int)((us >> (lg - 2)) & 3);
+}
+
+/* the upper bound of bucket b, in us */
+static uint64_t
+bucketTop(int b)
+{
+    if (b < 4) {
+	return b + 1;
+    }
+    return (uint64_t)(5 + b % 4) << (b / 4 - 1);
+}
+
+/*
+ * adds the time since start, from scaleClock(), to the histogram
+ */
+void
+scaleRecord(uint64_t start)
+{
+    if (!hist || !start) {
+	return;
+    }
+    __atomic_fetch_add(&hist->count[bucketOf((scaleClock() - start) / 1000)], 1,
+	__ATOMIC_RELAXED);
+}
+
+/*
+ * empties the histogram and returns its p99 in us, 0 if nothing was served
+ */
+static uint64_t
+takeP99(unsigned long *served)
+{
+    uint64_t count[SCALEBUCKETS], total = 0, seen = 0;
+    int b;
+
+    for (b = 0; b < SCALEBUCKETS; b++) {
+	count[b] = __atomic_exchange_n(&hist->count[b], 0, __ATOMIC_RELAXED);
+	total += count[b];
+    }
+    *served = total;
+
+    for (b = 0; b < SCALEBUCKETS && total; b++) {
+	seen += count[b];
+	if (seen * 100 >= total * 99) {
+	    return bucketTop(b);
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * returns how many connections wait to be accepted on the listeners.  For
+ * a listening socket Linux reports the accept queue as tcpi_unacked.
+ */
+static int
+queued(const int *socks, int nsocks)
+{
+    int n = 0;
+#if defined(__linux__) && defined(TCP_INFO)
+    struct tcp_info ti;
+    socklen_t len;
+    int i;
+
+    for (i = 0; i < nsocks; i++) {
+	len = sizeof(ti);
+	if (getsockopt(socks[i], IPPROTO_TCP, TCP_INFO, &ti, &len) == 0) {
+	    n += ti.tcpi_unacked;
+	}
+    }
+#else
+    (void)socks;
+    (void)nsocks;
+#endif
+
+    return n;
+}
+
+static void
+logDecision(int logfd, int from, int queue, int active, uint64_t p99,
+    unsigned long served)
+{
+    char line[256], when[32];
+    time_t now = time(NULL);
+    int n;
+
+    if (logfd < 0) {
+	return;
+    }
+
+    (void)strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    n = snprintf(line, sizeof(line), "# %s workers %d -> %d: queue %d, "
+	"busy %d/%d, %d idle, %lu served, p99 %.1fms\n",
+	when, from, limit, queue, busyOf(active), from, active - busyOf(active),
+	served, p99 / 1000.0);
+    if (n > 0 && write(logfd, line, n) < 0) {
+	perror("write");
+    }
+}
+
+/*
+ * looks at the load once every SCALETICK seconds and moves the worker
+ * limit.  Connections waiting in the accept queue, or every worker busy
+ * (idle keep-alive connections do not count), for SCALEUP ticks in a row
+ * grow it by half; the accept queue empty and fewer than half the workers
+ * busy for SCALEDOWN ticks shrink it by an eighth.  The gap between the
+ * two is the hysteresis.  Changes go to the log as '#' lines.
+ */
+void
+scaleTick(const int *socks, int nsocks, int active, int logfd)
+{
+    unsigned long served;
+    uint64_t now, p99;
+    int queue, busy, from = limit;
+
+    if (!hist || (now = scaleClock()) - lasttick < SCALETICK * 1000000000ULL) {
+	return;
+    }
+    lasttick = now;
+
+    queue = queued(socks, nsocks);
+    p99 = takeP99(&served);
+    busy = busyOf(active);
+
+    if (queue > 0 || busy >= limit) {
+	idleticks = 0;
+	if (++busyticks >= SCALEUP && limit < maxworkers &&
+	    (!target || p99 <= target * 1000ULL)) {
+	    limit += limit / 2 > 0 ? limit / 2 : 1;
+	    busyticks = 0;
+	}
+    } else if (busy < limit / 2) {
+	busyticks = 0;
+	if (++idleticks >= SCALEDOWN && limit > minworkers) {
+	    limit -= limit / 8 > 0 ? limit / 8 : 1;
+	    idleticks = 0;
+	}
+    } else {
+	busyticks = 0;
+	idleticks = 0;
+    }
+
+    if (limit > maxworkers) {
+	limit = maxworkers;
+    }
+    if (limit < minworkers) {
+	limit = minworkers;
+    }
+    if (limit != from) {
+	logDecision(logfd, from, queue, active, p99, served);
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef _SCALE_H_
+#define _SCALE_H_
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+#ifndef SCALETICK
+#define SCALETICK 1 /* seconds between looks at the load */
+#endif
+
+#ifndef SCALEUP
+#define SCALEUP 2 /* busy ticks in a row before adding workers */
+#endif
+
+#ifndef SCALEDOWN
+#define SCALEDOWN 10 /* idle ticks in a row before removing workers */
+#endif
+
+#ifndef SCALEIDLE
+#define SCALEIDLE 2 /* children, idle keep-alive ones included, per worker */
+#endif
+
+#ifndef SCALEBUCKETS
+#define SCALEBUCKETS 160 /* latency histogram, 4 buckets per power of 2 us */
+#endif
+
+int scaleInit(int, int, unsigned);
+int scaleLimit(void);
+int scaleAdmit(int);
+void scaleIdle(int);
+void scaleReap(pid_t);
+int scaleShed(void);
+uint64_t scaleClock(void);
+void scaleRecord(uint64_t);
+void scaleTick(const int *, int, int, int);
+
+#endif
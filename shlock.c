@@ -0,0 +1,45 @@
+#include <sys/types.h>
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "shlock.h"
+
+/*
+ * takes the lock, spinning briefly and then yielding.  Once it has been
+ * held for a while, its owner is checked on; if that process is gone (it
+ * was killed inside the critical section) the lock is taken over.  What
+ * it protected may be half updated then, so only use this for caches
+ * that tolerate a bad entry.
+ */
+void
+shlockAcquire(struct shlock *l)
+{
+    pid_t me = getpid(), owner = 0;
+    int spins = 0;
+
+    while (!__atomic_compare_exchange_n(&l->owner, &owner, me, 0,
+	__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+	if (++spins < SHLOCKSPIN) {
+	    owner = 0;
+	    continue;
+	}
+	spins = 0;
+
+	if (kill(owner, 0) < 0 && errno == ESRCH &&
+	    __atomic_compare_exchange_n(&l->owner, &owner, me, 0,
+	    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+	    return;
+	}
+	(void)sched_yield();
+	owner = 0;
+    }
+}
+
+void
+shlockRelease(struct shlock *l)
+{
+    __atomic_store_n(&l->owner, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,22 @@
+#ifndef _SHLOCK_H_
+#define _SHLOCK_H_
+
+#include <sys/types.h>
+
+#ifndef SHLOCKSPIN
+#define SHLOCKSPIN 1000 /* tries before yielding and checking on the owner */
+#endif
+
+/*
+ * a lock for data in a MAP_SHARED mapping, used by every forked child.
+ * It holds its owner's pid, so a child that dies holding it does not
+ * wedge the others.  Zero-filled is unlocked.
+ */
+struct shlock {
+    pid_t owner;
+};
+
+void shlockAcquire(struct shlock *);
+void shlockRelease(struct shlock *);
+
+#endif
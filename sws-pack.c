@@ -0,0 +1,623 @@
+/*
+ * sws-pack compiles a docroot into a single archive for sws -o pack=file:
+ * a minimal perfect hash from path to entry, pre-rendered headers and
+ * bodies aligned for sendfile.  A foo.gz next to foo becomes foo's gzip variant.
+ */
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <magic.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fsio.h"
+#include "pack.h"
+
+#ifndef MAXDISP
+#define MAXDISP 10000000 /* displacements tried per bucket before giving up */
+#endif
+
+#ifndef COPYBUF
+#define COPYBUF 65536
+#endif
+
+struct file {
+    char *path;
+    struct stat sb;
+    char *gzpath;	/* NULL if there is no precompressed sibling */
+    off_t gzlen;
+    char *mime;
+    uint64_t hash[2];	/* of the identity and gzip bodies, for the ETag */
+};
+
+struct item {
+    char *uri;
+    size_t file;	/* index into files; index.html is there twice */
+};
+
+static struct file *files = NULL;
+static size_t nfiles = 0, maxfiles = 0;
+static struct item *items = NULL;
+static size_t nitems = 0, maxitems = 0;
+static char *root = NULL;
+static size_t rootlen = 0;
+static int rootfd = -1;
+
+static char *blob = NULL;	/* the string area, uris, ETags and headers */
+static size_t bloblen = 0, blobmax = 0;
+
+static int verbose = 0;
+
+static void
+usage(void)
+{
+    (void)fprintf(stderr, "usage: sws-pack [-v] dir archive\n");
+}
+
+static void *
+grow(void *p, size_t *max, size_t n, size_t size)
+{
+    void *q;
+
+    if (n < *max) {
+	return p;
+    }
+    *max = *max ? *max * 2 : 64;
+    if ((q = realloc(p, *max * size)) == NULL) {
+	perror("realloc");
+	exit(EXIT_FAILURE);
+    }
+    return q;
+}
+
+static void
+addItem(const char *uri, size_t file)
+{
+    items = grow(items, &maxitems, nitems, sizeof(*items));
+    if ((items[nitems].uri = strdup(uri)) == NULL) {
+	perror("strdup");
+	exit(EXIT_FAILURE);
+    }
+    items[nitems].file = file;
+    nitems++;
+}
+
+/*
+ * checks that sws would follow the symlink rel, "/" and all, beneath
+ * root: with openat2(2) the kernel refuses absolute targets and anything
+ * that leaves root, otherwise sws compares the real path against root.
+ * return values:
+ *  -1: sws would not serve it
+ *  0: it may be packed, sb is what it points to
+ */
+static int
+beneath(const char *path, const char *rel, struct stat *sb)
+{
+    char *real;
+    int fd;
+
+    if ((fd = fsioOpenBeneath(rootfd, rel + 1, O_RDONLY)) >= 0) {
+	if (fstat(fd, sb) < 0) {
+	    (void)close(fd);
+	    return -1;
+	}
+	(void)close(fd);
+	return 0;
+    }
+    if (errno != ENOSYS) {
+	return -1;
+    }
+
+    if ((real = realpath(path, NULL)) == NULL) {
+	return -1;
+    }
+    if (strncmp(real, root, rootlen) != 0 ||
+	(real[rootlen] != '/' && real[rootlen] != '\0') ||
+	stat(real, sb) < 0) {
+	free(real);
+	return -1;
+    }
+    free(real);
+
+    return 0;
+}
+
+/*
+ * nftw() callback: every regular file under root becomes an entry, and
+ * dir/index.html is also entered as dir/.  Symlinks are only followed
+ * where sws would follow them, so a packed docroot serves what the live
+ * one does.
+ */
+static int
+collect(const char *path, const struct stat *lsb, int type, struct FTW *ftw)
+{
+    const char *rel = path + rootlen;
+    struct stat sb = *lsb;
+    char *uri;
+    struct file *f;
+
+    (void)ftw;
+
+    if (type == FTW_SL) {
+	if (rel[0] != '/' || beneath(path, rel, &sb) < 0) {
+	    return 0;
+	}
+    } else if (type != FTW_F) {
+	return 0;
+    }
+
+    /* ~user is never looked up in the docroot */
+    if (!S_ISREG(sb.st_mode) || rel[0] != '/' || rel[1] == '~') {
+	return 0;
+    }
+
+    files = grow(files, &maxfiles, nfiles, sizeof(*files));
+    f = &files[nfiles];
+    memset(f, 0, sizeof(*f));
+    f->sb = sb;
+    if ((f->path = strdup(path)) == NULL) {
+	perror("strdup");
+	exit(EXIT_FAILURE);
+    }
+    addItem(rel, nfiles);
+
+    if (strlen(rel) >= 11 && strcmp(rel + strlen(rel) - 11, "/index.html") == 0) {
+	if ((uri = strndup(rel, strlen(rel) - 10)) == NULL) {
+	    perror("strndup");
+	    exit(EXIT_FAILURE);
+	}
+	addItem(uri, nfiles);
+	free(uri);
+    }
+
+    nfiles++;
+    return 0;
+}
+
+static uint64_t
+hashFile(const char *path, off_t len)
+{
+    char buf[COPYBUF];
+    uint64_t h = 0xcbf29ce484222325ULL;
+    off_t total = 0;
+    ssize_t n, i;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+	perror(path);
+	exit(EXIT_FAILURE);
+    }
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+	for (i = 0; i < n; i++) {
+	    h = (h ^ (unsigned char)buf[i]) * 0x100000001b3ULL;
+	}
+	total += n;
+    }
+    (void)close(fd);
+
+    if (n < 0 || total != len) {
+	(void)fprintf(stderr, "sws-pack: %s changed while packing\n", path);
+	exit(EXIT_FAILURE);
+    }
+
+    return h;
+}
+
+/*
+ * finds the MIME type, the gzip sibling and the content hashes
+ */
+static void
+inspect(struct file *f, magic_t cookie)
+{
+    const char *mime = NULL;
+    struct stat gsb;
+    char *gz;
+    int fd;
+
+    if ((fd = open(f->path, O_RDONLY)) >= 0) {
+	if (cookie) {
+	    mime = magic_descriptor(cookie, fd);
+	}
+	(void)close(fd);
+    }
+    if ((f->mime = strdup(mime ? mime : "application/octet-stream")) == NULL) {
+	perror("strdup");
+	exit(EXIT_FAILURE);
+    }
+    f->hash[0] = hashFile(f->path, f->sb.st_size);
+
+    if (asprintf(&gz, "%s.gz", f->path) < 0) {
+	perror("asprintf");
+	exit(EXIT_FAILURE);
+    }
+    if (stat(gz, &gsb) == 0 && S_ISREG(gsb.st_mode)) {
+	f->gzpath = gz;
+	f->gzlen = gsb.st_size;
+	f->hash[1] = hashFile(gz, gsb.st_size);
+    } else {
+	free(gz);
+    }
+}
+
+static const size_t *bucketsize;
+
+static int
+biggerBucket(const void *a, const void *b)
+{
+    size_t x = bucketsize[*(const size_t *)a], y = bucketsize[*(const size_t *)b];
+
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/*
+ * hash and displace: items are spread over nitems buckets, and the
+ * buckets are placed biggest first, each with the first displacement
+ * that lands all of its items on free slots.  Buckets of one item take
+ * any free slot directly.  slot[i] is where item i ends up.
+ * return values:
+ *  -1: some bucket could not be placed
+ *  0: success
+ */
+static int
+buildIndex(int32_t *disp, uint32_t *slot)
+{
+    size_t *count, *start, *member, *order, i, j, k, n = nitems;
+    uint32_t *try;
+    char *taken;
+    int32_t d;
+
+    count = calloc(n + 1, sizeof(*count));
+    start = calloc(n + 1, sizeof(*start));
+    member = calloc(n, sizeof(*member));
+    order = calloc(n, sizeof(*order));
+    taken = calloc(n, 1);
+    try = calloc(n, sizeof(*try));
+    if (!count || !start || !member || !order || !taken || !try) {
+	perror("calloc");
+	exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < n; i++) {
+	count[packHash(0, items[i].uri, strlen(items[i].uri)) % n]++;
+    }
+    for (i = 0; i < n; i++) {
+	start[i + 1] = start[i] + count[i];
+    }
+    memset(count, 0, n * sizeof(*count));
+    for (i = 0; i < n; i++) {
+	size_t b = packHash(0, items[i].uri, strlen(items[i].uri)) % n;
+
+	member[start[b] + count[b]++] = i;
+    }
+
+    for (i = 0; i < n; i++) {
+	order[i] = i;
+    }
+    bucketsize = count;
+    qsort(order, n, sizeof(*order), biggerBucket);
+
+    for (i = 0; i < n; i++) {
+	size_t b = order[i];
+
+	if (count[b] <= 1) {
+	    break;
+	}
+	for (d = 1; d < MAXDISP; d++) {
+	    for (j = 0; j < count[b]; j++) {
+		const char *uri = items[member[start[b] + j]].uri;
+
+		try[j] = packHash((uint32_t)d, uri, strlen(uri)) % n;
+		if (taken[try[j]]) {
+		    break;
+		}
+		for (k = 0; k < j && try[k] != try[j]; k++) {
+		    ;
+		}
+		if (k < j) {
+		    break;
+		}
+	    }
+	    if (j == count[b]) {
+		break;
+	    }
+	}
+	if (d == MAXDISP) {
+	    return -1;
+	}
+	disp[b] = d;
+	for (j = 0; j < count[b]; j++) {
+	    taken[try[j]] = 1;
+	    slot[member[start[b] + j]] = try[j];
+	}
+    }
+
+    for (k = 0; i < n && count[order[i]] == 1; i++) {
+	size_t b = order[i];
+
+	while (taken[k]) {
+	    k++;
+	}
+	taken[k] = 1;
+	disp[b] = -(int32_t)k - 1;
+	slot[member[start[b]]] = (uint32_t)k;
+    }
+
+    free(count);
+    free(start);
+    free(member);
+    free(order);
+    free(taken);
+    free(try);
+
+    return 0;
+}
+
+/*
+ * appends to the string area.
+ * returns the offset of what was added, relative to the area.
+ */
+__attribute__((format(printf, 1, 2)))
+static uint64_t
+blobPrintf(const char *fmt, ...)
+{
+    va_list ap;
+    uint64_t off = bloblen;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    while (bloblen + n + 1 > blobmax) {
+	blobmax = blobmax ? blobmax * 2 : 65536;
+	if ((blob = realloc(blob, blobmax)) == NULL) {
+	    perror("realloc");
+	    exit(EXIT_FAILURE);
+	}
+    }
+
+    va_start(ap, fmt);
+    (void)vsnprintf(blob + bloblen, n + 1, fmt, ap);
+    va_end(ap);
+    bloblen += n + 1;
+
+    return off;
+}
+
+/*
+ * where a body of len bytes goes if the last one ended at off.  Bodies
+ * of a page or more start on a page, smaller ones are packed tight so
+ * that a tree of small files does not become mostly padding.
+ */
+static uint64_t
+align(uint64_t off, uint64_t len)
+{
+    uint64_t a = len >= PACKALIGN ? PACKALIGN : 16;
+
+    return (off + a - 1) & ~(a - 1);
+}
+
+static void
+copyFile(int out, const char *path, uint64_t off, off_t len)
+{
+    char buf[COPYBUF];
+    off_t total = 0;
+    ssize_t n;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+	perror(path);
+	exit(EXIT_FAILURE);
+    }
+    while (total < len && (n = read(fd, buf, sizeof(buf))) > 0) {
+	if (n > len - total) {
+	    n = len - total;
+	}
+	if (pwrite(out, buf, n, off + total) != n) {
+	    perror("pwrite");
+	    exit(EXIT_FAILURE);
+	}
+	total += n;
+    }
+    (void)close(fd);
+
+    if (total != len) {
+	(void)fprintf(stderr, "sws-pack: %s changed while packing\n", path);
+	exit(EXIT_FAILURE);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    struct packhdr h;
+    struct packent *ents;
+    uint64_t (*body)[2], base, end;
+    uint32_t *slot;
+    int32_t *disp;
+    char date[64], *tmp;
+    magic_t cookie;
+    size_t i;
+    int ch, out;
+
+    while ((ch = getopt(argc, argv, "hv")) != -1) {
+	switch (ch) {
+	case 'v':
+	    verbose = 1;
+	    break;
+	case 'h':
+	    usage();
+	    return 0;
+	default:
+	    usage();
+	    exit(EXIT_FAILURE);
+	}
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc != 2) {
+	usage();
+	exit(EXIT_FAILURE);
+    }
+
+    if ((root = realpath(argv[0], NULL)) == NULL) {
+	perror(argv[0]);
+	exit(EXIT_FAILURE);
+    }
+    rootlen = strlen(root);
+    if ((rootfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+	perror(root);
+	exit(EXIT_FAILURE);
+    }
+    if (nftw(root, collect, 64, FTW_PHYS) < 0) {
+	perror(root);
+	exit(EXIT_FAILURE);
+    }
+    if (nitems > INT32_MAX) {
+	(void)fprintf(stderr, "sws-pack: too many files\n");
+	exit(EXIT_FAILURE);
+    }
+
+    if ((cookie = magic_open(MAGIC_MIME_TYPE)) != NULL &&
+	magic_load(cookie, NULL) != 0) {
+	magic_close(cookie);
+	cookie = NULL;
+    }
+    for (i = 0; i < nfiles; i++) {
+	inspect(&files[i], cookie);
+    }
+
+    disp = calloc(nitems ? nitems : 1, sizeof(*disp));
+    slot = calloc(nitems ? nitems : 1, sizeof(*slot));
+    ents = calloc(nitems ? nitems : 1, sizeof(*ents));
+    body = calloc(nfiles ? nfiles : 1, sizeof(*body));
+    if (!disp || !slot || !ents || !body) {
+	perror("calloc");
+	exit(EXIT_FAILURE);
+    }
+    if (buildIndex(disp, slot) < 0) {
+	(void)fprintf(stderr, "sws-pack: could not build the index\n");
+	exit(EXIT_FAILURE);
+    }
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, PACKMAGIC, sizeof(h.magic));
+    h.nent = (uint32_t)nitems;
+    h.disp = sizeof(h);
+    h.ent = (h.disp + nitems * sizeof(*disp) + 7) & ~(uint64_t)7;
+    base = h.ent + nitems * sizeof(*ents);
+
+    /* strings first, so that the bodies can start after them */
+    for (i = 0; i < nitems; i++) {
+	struct packent *e = &ents[slot[i]];
+	struct file *f = &files[items[i].file];
+	struct tm tm;
+	int v;
+
+	e->uri = blobPrintf("%s", items[i].uri);
+	e->urilen = (uint32_t)strlen(items[i].uri);
+	e->mtime = f->sb.st_mtime;
+	e->nvar = f->gzpath ? 2 : 1;
+
+	(void)gmtime_r(&f->sb.st_mtime, &tm);
+	(void)strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+	for (v = 0; v < (int)e->nvar; v++) {
+	    struct packvar *pv = &e->var[v];
+	    char etag[32];
+	    uint64_t head;
+
+	    /* blobPrintf() may move blob, so nothing in it is passed back in */
+	    (void)snprintf(etag, sizeof(etag), "\"%016" PRIx64 "%s\"", f->hash[v],
+		v ? "-gz" : "");
+	    pv->etag = blobPrintf("%s", etag);
+	    pv->bodylen = v ? (uint64_t)f->gzlen : (uint64_t)f->sb.st_size;
+	    head = blobPrintf("Server: sws/1.0\r\n"
+		"Last-Modified: %s\r\n"
+		"Content-Type: %s\r\n"
+		"ETag: %s\r\n"
+		"%s%s"
+		"Content-Length: %" PRIu64 "\r\n",
+		date, f->mime, etag,
+		v ? "Content-Encoding: gzip\r\n" : "",
+		f->gzpath ? "Vary: Accept-Encoding\r\n" : "",
+		pv->bodylen);
+	    pv->headlen = (uint32_t)strlen(blob + head);
+	    pv->head = head;
+	}
+    }
+
+    end = base + bloblen;
+    for (i = 0; i < nfiles; i++) {
+	body[i][0] = align(end, files[i].sb.st_size);
+	end = body[i][0] + files[i].sb.st_size;
+	if (files[i].gzpath) {
+	    body[i][1] = align(end, files[i].gzlen);
+	    end = body[i][1] + files[i].gzlen;
+	}
+    }
+    h.size = end;
+
+    for (i = 0; i < nitems; i++) {
+	struct packent *e = &ents[slot[i]];
+	uint32_t v;
+
+	e->uri += base;
+	for (v = 0; v < e->nvar; v++) {
+	    e->var[v].etag += base;
+	    e->var[v].head += base;
+	    e->var[v].body = body[items[i].file][v];
+	}
+    }
+
+    /* written aside and renamed, a running sws keeps its old mapping */
+    if (asprintf(&tmp, "%s.tmp", argv[1]) < 0) {
+	perror("asprintf");
+	exit(EXIT_FAILURE);
+    }
+    if ((out = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+	perror(tmp);
+	exit(EXIT_FAILURE);
+    }
+    if (ftruncate(out, (off_t)h.size) < 0 ||
+	pwrite(out, &h, sizeof(h), 0) != sizeof(h) ||
+	pwrite(out, disp, nitems * sizeof(*disp), h.disp) !=
+	    (ssize_t)(nitems * sizeof(*disp)) ||
+	pwrite(out, ents, nitems * sizeof(*ents), h.ent) !=
+	    (ssize_t)(nitems * sizeof(*ents)) ||
+	pwrite(out, blob, bloblen, base) != (ssize_t)bloblen) {
+	perror(tmp);
+	(void)unlink(tmp);
+	exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < nfiles; i++) {
+	copyFile(out, files[i].path, body[i][0], files[i].sb.st_size);
+	if (files[i].gzpath) {
+	    copyFile(out, files[i].gzpath, body[i][1], files[i].gzlen);
+	}
+    }
+    if (fsync(out) < 0 || close(out) < 0 || rename(tmp, argv[1]) < 0) {
+	perror(argv[1]);
+	(void)unlink(tmp);
+	exit(EXIT_FAILURE);
+    }
+
+    if (verbose) {
+	(void)fprintf(stderr, "sws-pack: %zu entries, %zu files, %" PRIu64
+	    " bytes\n", nitems, nfiles, h.size);
+    }
+
+    return 0;
+}
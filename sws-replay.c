@@ -0,0 +1,641 @@
+/*
+ * sws-replay sends the requests recorded in an sws access log (or a JSONL
+ * capture) to a server, with their original spacing, sped up, or as fast
+ * as it will take them, and reports throughput, latency and every status
+ * that differs from the one logged.
+ */
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef MAXCONNS
+#define MAXCONNS 64 /* requests in flight at once, -c */
+#endif
+
+#ifndef MAXDIVERGE
+#define MAXDIVERGE 32 /* distinct logged -> replayed status pairs reported */
+#endif
+
+#ifndef MAXWAIT
+#define MAXWAIT 1000 /* ms slept at most before looking at the clock again */
+#endif
+
+#ifndef RECVBUF
+#define RECVBUF 65536
+#endif
+
+struct record {
+    double at;		/* seconds after the first record */
+    char *line;		/* the request line, e.g. "GET / HTTP/1.0" */
+    int status;		/* as logged, 0 if unknown */
+    size_t seq;		/* position in the file, ties keep their order */
+};
+
+enum state { CONNECTING, SENDING, READING };
+
+struct conn {
+    int fd;
+    enum state state;
+    size_t rec;
+    char *out;
+    size_t outlen;
+    size_t sent;
+    char head[16];	/* enough of the response for its status */
+    size_t headlen;
+    size_t bytes;
+    double start;
+};
+
+struct diverge {
+    int logged;
+    int got;
+    unsigned long count;
+};
+
+static struct record *recs = NULL;
+static size_t nrecs = 0, maxrecs = 0;
+static unsigned long skipped = 0;
+
+static double *lat = NULL;
+static size_t nlat = 0;
+static unsigned long errors = 0, matched = 0;
+static unsigned long long received = 0;
+static struct diverge diverged[MAXDIVERGE];
+static int ndiverged = 0;
+static unsigned long otherdiverged = 0;
+
+static void
+usage(void)
+{
+    (void)fprintf(stderr, "usage: sws-replay [-m] [-c conns] [-i address] "
+	"[-n count] [-p port] [-s speed] file\n");
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+addRecord(double t, const char *line, size_t len, int status)
+{
+    struct record *r;
+
+    if (nrecs == maxrecs) {
+	maxrecs = maxrecs ? maxrecs * 2 : 1024;
+	if ((recs = realloc(recs, maxrecs * sizeof(*recs))) == NULL) {
+	    perror("realloc");
+	    exit(EXIT_FAILURE);
+	}
+    }
+
+    r = &recs[nrecs];
+    if ((r->line = strndup(line, len)) == NULL) {
+	perror("strndup");
+	exit(EXIT_FAILURE);
+    }
+    r->at = t;
+    r->status = status;
+    r->seq = nrecs;
+    nrecs++;
+}
+
+static double
+parseTime(const char *s)
+{
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(s, "%Y-%m-%dT%H:%M:%SZ", &tm) == NULL) {
+	return -1;
+    }
+    return (double)timegm(&tm);
+}
+
+/*
+ * an sws log line: rip time "request line" status bytes
+ * return values:
+ *  -1: not one
+ *  0: added
+ */
+static int
+parseLog(const char *line)
+{
+    const char *q1, *q2, *sp;
+    char when[32];
+    double t;
+
+    if ((sp = strchr(line, ' ')) == NULL) {
+	return -1;
+    }
+    sp++;
+    if ((q1 = strchr(sp, ' ')) == NULL || (size_t)(q1 - sp) >= sizeof(when)) {
+	return -1;
+    }
+    memcpy(when, sp, q1 - sp);
+    when[q1 - sp] = '\0';
+
+    if (q1[1] != '"' || (q2 = strrchr(q1 + 2, '"')) == NULL) {
+	return -1;
+    }
+    q1 += 2;
+
+    if ((t = parseTime(when)) < 0) {
+	return -1;
+    }
+    addRecord(t, q1, q2 - q1, atoi(q2 + 1));
+
+    return 0;
+}
+
+/*
+ * finds "key": in a flat JSON object and returns its value, a string
+ * with the common escapes undone, or the bare token for a number.
+ * return values:
+ *  NULL: no such key
+ *  otherwise: the value, in buf
+ */
+static char *
+jsonField(const char *obj, const char *key, char *buf, size_t size)
+{
+    char pat[64];
+    const char *p;
+    size_t n = 0;
+
+    (void)snprintf(pat, sizeof(pat), "\"%s\"", key);
+    if ((p = strstr(obj, pat)) == NULL) {
+	return NULL;
+    }
+    p += strlen(pat);
+    while (*p == ' ' || *p == '\t' || *p == ':') {
+	p++;
+    }
+
+    if (*p != '"') {
+	while (*p && *p != ',' && *p != '}' && *p != ' ' && n < size - 1) {
+	    buf[n++] = *p++;
+	}
+	buf[n] = '\0';
+	return buf;
+    }
+
+    for (p++; *p && *p != '"' && n < size - 1; p++) {
+	if (*p == '\\' && p[1]) {
+	    p++;
+	    switch (*p) {
+	    case 'n': buf[n++] = '\n'; break;
+	    case 'r': buf[n++] = '\r'; break;
+	    case 't': buf[n++] = '\t'; break;
+	    case 'u': buf[n++] = '?'; p += 4; break;
+	    default: buf[n++] = *p; break;
+	    }
+	    continue;
+	}
+	buf[n++] = *p;
+    }
+    buf[n] = '\0';
+
+    return buf;
+}
+
+/*
+ * a JSONL record: {"time": ..., "request": "GET / HTTP/1.0", "status": 200}.
+ * time is seconds or an sws log timestamp; "method" and "uri" may stand
+ * in for "request".
+ * return values:
+ *  -1: not one
+ *  0: added
+ */
+static int
+parseJson(const char *line)
+{
+    char req[BUFSIZ], val[64], method[16], uri[BUFSIZ - 32];
+    double t = 0;
+    int status = 0;
+
+    if (jsonField(line, "time", val, sizeof(val)) != NULL &&
+	(t = parseTime(val)) < 0) {
+	t = strtod(val, NULL);
+    }
+    if (jsonField(line, "status", val, sizeof(val)) != NULL) {
+	status = atoi(val);
+    }
+
+    if (jsonField(line, "request", req, sizeof(req)) == NULL) {
+	if (jsonField(line, "uri", uri, sizeof(uri)) == NULL) {
+	    return -1;
+	}
+	if (jsonField(line, "method", method, sizeof(method)) == NULL) {
+	    (void)snprintf(method, sizeof(method), "GET");
+	}
+	(void)snprintf(req, sizeof(req), "%s %s HTTP/1.0", method, uri);
+    }
+
+    addRecord(t, req, strlen(req), status);
+    return 0;
+}
+
+static int
+byTime(const void *a, const void *b)
+{
+    const struct record *x = a, *y = b;
+
+    if (x->at != y->at) {
+	return x->at < y->at ? -1 : 1;
+    }
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/*
+ * reads every record, then makes times relative to the first one.  Log
+ * times only have whole seconds, so requests logged in the same second
+ * are spread evenly over it instead of all being sent at once.
+ */
+static void
+load(FILE *fp)
+{
+    char *line = NULL;
+    size_t cap = 0, i, j, k;
+    ssize_t len;
+    double t0;
+
+    while ((len = getline(&line, &cap, fp)) > 0) {
+	while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+	    line[--len] = '\0';
+	}
+	if (len == 0 || line[0] == '#') { /* sws writes its notes this way */
+	    continue;
+	}
+	if ((line[0] == '{' ? parseJson(line) : parseLog(line)) < 0) {
+	    skipped++;
+	}
+    }
+    free(line);
+
+    if (nrecs == 0) {
+	return;
+    }
+
+    /* sws logs when a response is done, so neighbours can be out of order */
+    qsort(recs, nrecs, sizeof(*recs), byTime);
+    t0 = recs[0].at;
+    for (i = 0; i < nrecs; i = j) {
+	for (j = i; j < nrecs && recs[j].at == recs[i].at; j++) {
+	    ;
+	}
+	for (k = i; k < j; k++) {
+	    recs[k].at = recs[k].at - t0 + (double)(k - i) / (j - i);
+	}
+    }
+}
+
+static void
+noteStatus(int logged, int got)
+{
+    int i;
+
+    /* conditional headers are not logged, so a 304 cannot be asked for again */
+    if (logged == 0 || logged == got || (logged == 304 && got == 200)) {
+	matched += logged != 0;
+	return;
+    }
+
+    for (i = 0; i < ndiverged; i++) {
+	if (diverged[i].logged == logged && diverged[i].got == got) {
+	    diverged[i].count++;
+	    return;
+	}
+    }
+    if (ndiverged < MAXDIVERGE) {
+	diverged[ndiverged].logged = logged;
+	diverged[ndiverged].got = got;
+	diverged[ndiverged].count = 1;
+	ndiverged++;
+    } else {
+	otherdiverged++;
+    }
+}
+
+static void
+finish(struct conn *c, int failed)
+{
+    int status = 0;
+
+    (void)close(c->fd);
+    c->fd = -1;
+    free(c->out);
+    c->out = NULL;
+
+    if (!failed) {
+	c->head[c->headlen] = '\0';
+	if (strncmp(c->head, "HTTP/", 5) == 0 && strchr(c->head, ' ')) {
+	    status = atoi(strchr(c->head, ' ') + 1);
+	}
+    }
+    if (failed || status == 0) {
+	errors++;
+	noteStatus(recs[c->rec].status, 0);
+	return;
+    }
+
+    lat[nlat++] = now() - c->start;
+    received += c->bytes;
+    noteStatus(recs[c->rec].status, status);
+}
+
+/*
+ * starts record i on c.  Each request gets its own connection and asks
+ * for it to be closed, so the end of the response is simply EOF.
+ */
+static int
+start(struct conn *c, size_t i, const struct addrinfo *ai, const char *host)
+{
+    c->rec = i;
+    c->sent = 0;
+    c->headlen = 0;
+    c->bytes = 0;
+    c->start = now();
+
+    if (asprintf(&c->out, "%s\r\nHost: %s\r\nConnection: close\r\n\r\n",
+	recs[i].line, host) < 0) {
+	c->out = NULL;
+	return -1;
+    }
+    c->outlen = strlen(c->out);
+
+    if ((c->fd = socket(ai->ai_family, SOCK_STREAM, 0)) < 0) {
+	perror("socket");
+	free(c->out);
+	c->out = NULL;
+	return -1;
+    }
+    (void)fcntl(c->fd, F_SETFL, O_NONBLOCK);
+
+    if (connect(c->fd, ai->ai_addr, ai->ai_addrlen) < 0 && errno != EINPROGRESS) {
+	finish(c, 1);
+	return 0;
+    }
+    c->state = CONNECTING;
+
+    return 0;
+}
+
+static void
+progress(struct conn *c, short revents)
+{
+    char buf[RECVBUF];
+    socklen_t len = sizeof(int);
+    ssize_t n;
+    int err = 0;
+
+    if (c->state == CONNECTING) {
+	if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+	    finish(c, 1);
+	    return;
+	}
+	c->state = SENDING;
+    }
+
+    if (c->state == SENDING) {
+	if ((n = send(c->fd, c->out + c->sent, c->outlen - c->sent,
+	    MSG_NOSIGNAL)) < 0) {
+	    if (errno != EAGAIN) {
+		finish(c, 1);
+	    }
+	    return;
+	}
+	c->sent += n;
+	if (c->sent == c->outlen) {
+	    c->state = READING;
+	}
+	return;
+    }
+
+    if (!(revents & (POLLIN | POLLHUP | POLLERR))) {
+	return;
+    }
+    while ((n = read(c->fd, buf, sizeof(buf))) > 0) {
+	if (c->headlen < sizeof(c->head) - 1) {
+	    size_t take = sizeof(c->head) - 1 - c->headlen;
+
+	    if (take > (size_t)n) {
+		take = n;
+	    }
+	    memcpy(c->head + c->headlen, buf, take);
+	    c->headlen += take;
+	}
+	c->bytes += n;
+    }
+    if (n == 0) {
+	finish(c, 0);
+    } else if (errno != EAGAIN) {
+	finish(c, 1);
+    }
+}
+
+static int
+byValue(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double
+percentile(double q)
+{
+    return lat[(size_t)(q * (nlat - 1))] * 1000;
+}
+
+static void
+report(double elapsed, double lag)
+{
+    int i;
+
+    qsort(lat, nlat, sizeof(*lat), byValue);
+
+    (void)printf("requests:   %zu replayed, %zu answered, %lu failed, "
+	"%lu log lines skipped\n", nrecs, nlat, errors, skipped);
+    (void)printf("elapsed:    %.3f s, %.1f requests/s, %.1f KB/s\n", elapsed,
+	elapsed > 0 ? nlat / elapsed : 0, elapsed > 0 ? received / elapsed / 1024 : 0);
+    if (nlat > 0) {
+	(void)printf("latency:    p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+	    percentile(0.50), percentile(0.90), percentile(0.99), percentile(1.0));
+    }
+    if (lag > 0.05) {
+	(void)printf("behind:     up to %.3f s late, -c may be too low\n", lag);
+    }
+
+    (void)printf("status:     %lu as logged\n", matched);
+    for (i = 0; i < ndiverged; i++) {
+	(void)printf("            %lu logged %d, got %d\n", diverged[i].count,
+	    diverged[i].logged, diverged[i].got);
+    }
+    if (otherdiverged) {
+	(void)printf("            %lu other differences\n", otherdiverged);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *host = "localhost", *port = "8080";
+    struct addrinfo hints, *ai;
+    struct conn *conns;
+    struct pollfd *pfds;
+    double speed = 1, t0, lag = 0;
+    size_t maxconns = MAXCONNS, limit = 0, next = 0, active = 0, i, n;
+    int ch, maxrate = 0, err;
+    FILE *fp;
+
+    while ((ch = getopt(argc, argv, "hmc:i:n:p:s:")) != -1) {
+	switch (ch) {
+	case 'c':
+	    maxconns = strtoul(optarg, NULL, 10);
+	    break;
+	case 'h':
+	    usage();
+	    return 0;
+	case 'i':
+	    host = optarg;
+	    break;
+	case 'm':
+	    maxrate = 1;
+	    break;
+	case 'n':
+	    limit = strtoul(optarg, NULL, 10);
+	    break;
+	case 'p':
+	    port = optarg;
+	    break;
+	case 's':
+	    speed = strtod(optarg, NULL);
+	    break;
+	default:
+	    usage();
+	    exit(EXIT_FAILURE);
+	}
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc != 1 || maxconns == 0 || speed <= 0) {
+	usage();
+	exit(EXIT_FAILURE);
+    }
+
+    if (strcmp(argv[0], "-") == 0) {
+	fp = stdin;
+    } else if ((fp = fopen(argv[0], "r")) == NULL) {
+	perror(argv[0]);
+	exit(EXIT_FAILURE);
+    }
+    load(fp);
+    if (limit > 0 && limit < nrecs) {
+	nrecs = limit;
+    }
+    if (nrecs == 0) {
+	(void)fprintf(stderr, "sws-replay: no requests in %s\n", argv[0]);
+	exit(EXIT_FAILURE);
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if ((err = getaddrinfo(host, port, &hints, &ai)) != 0) {
+	(void)fprintf(stderr, "sws-replay: %s: %s\n", host, gai_strerror(err));
+	exit(EXIT_FAILURE);
+    }
+
+    conns = calloc(maxconns, sizeof(*conns));
+    pfds = calloc(maxconns, sizeof(*pfds));
+    lat = calloc(nrecs, sizeof(*lat));
+    if (!conns || !pfds || !lat) {
+	perror("calloc");
+	exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < maxconns; i++) {
+	conns[i].fd = -1;
+    }
+
+    t0 = now();
+    while (next < nrecs || active > 0) {
+	double t = now() - t0;
+	int timeout = -1;
+
+	/* start whatever is due, in free slots */
+	for (i = 0; i < maxconns && next < nrecs; i++) {
+	    double due = recs[next].at / speed;
+
+	    if (!maxrate && due > t) {
+		break;
+	    }
+	    if (conns[i].fd >= 0) {
+		continue;
+	    }
+	    if (!maxrate && t - due > lag) {
+		lag = t - due;
+	    }
+	    if (start(&conns[i], next++, ai, host) < 0) {
+		exit(EXIT_FAILURE);
+	    }
+	}
+
+	if (!maxrate && next < nrecs) {
+	    /* a log spanning downtime leaves days to wait, too many ms for int */
+	    double ms = (recs[next].at / speed - t) * 1000 + 1;
+
+	    timeout = ms < 0 ? 0 : ms > MAXWAIT ? MAXWAIT : (int)ms;
+	}
+
+	for (i = 0, n = 0; i < maxconns; i++) {
+	    pfds[i].fd = conns[i].fd;
+	    pfds[i].events = conns[i].state == READING ? POLLIN : POLLOUT;
+	    pfds[i].revents = 0;
+	    n += conns[i].fd >= 0;
+	}
+	active = n;
+	if (active == 0 && next >= nrecs) {
+	    break;
+	}
+	if (active == maxconns || (maxrate && active > 0)) {
+	    timeout = -1; /* nothing can start until something finishes */
+	}
+
+	if (poll(pfds, maxconns, timeout) < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    perror("poll");
+	    exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < maxconns; i++) {
+	    if (conns[i].fd >= 0 && pfds[i].revents) {
+		progress(&conns[i], pfds[i].revents);
+	    }
+	}
+    }
+
+    report(now() - t0, lag);
+    freeaddrinfo(ai);
+
+    return errors > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -13,6 +13,7 @@
 #include <limits.h>
 #include <magic.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdio.h>
@@ -21,12 +22,22 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "arena.h"
+#include "conn.h"
+#include "docindex.h"
+#include "fsio.h"
+#include "hints.h"
+#include "listen.h"
+#include "pack.h"
 #include "parse.h"
+#include "ratelimit.h"
+#include "resolve.h"
+#include "scale.h"
 #include "sws.h"
-
-#ifndef MAXPENDING
-#define MAXPENDING 5
-#endif
+#include "trace.h"
+#include "upgrade.h"
+#include "warm.h"
+#include "writer.h"
 
 #ifndef SLEEP
 #define SLEEP 5
@@ -37,15 +48,34 @@
 #define TIMEBUFSIZ 22
 #endif
 
-#ifndef MAXUSERNAME
-#define MAXUSERNAME 256 /* 255 is classic UNIX username limit */
-#endif
-
 #ifndef MAXDATE
 #define MAXDATE 32 /* 31 is the longest valid HTTP date string */
 #endif
 
 
+#ifndef KEEPALIVE
+#define KEEPALIVE 5 /* seconds an idle HTTP/1.1 connection is kept */
+#endif
+
+#ifndef KEEPALIVEMAX
+#define KEEPALIVEMAX 100 /* requests served on one connection */
+#endif
+
+#ifndef READTIMEOUT
+#define READTIMEOUT 30 /* seconds a request may take to arrive */
+#endif
+
+#ifndef CONNSLAB
+#define CONNSLAB 64 /* connection objects allocated per slab */
+#endif
+
+/* CGI scripts may be execute-only, so they are not opened for reading */
+#ifdef O_PATH
+#define CGIOPEN O_PATH
+#else
+#define CGIOPEN O_RDONLY
+#endif
+
 #ifndef FLAG_EXISTS
 #define FLAG_EXISTS 1
 #endif
@@ -62,10 +92,35 @@
 #define FLAG_CGI 8
 #endif
 
+extern char **environ;
+
+static int verbose = 0;
+static struct pool connpool;
+static magic_t magic_cookie = NULL;
+static struct listenopts listenopts;
+static unsigned tracesample = 0;
+static const char *tracefile = NULL;
+static const char *packfile = NULL;
+static int hintscan = 0;
+static const char *hintfile = NULL;
+static int docindex = 0;
+static int minworkers = 0;
+static int maxworkers = 0;
+static unsigned p99target = 0;
+static int warmtop = 0;
+static double warmtime = WARMTIME;
+static size_t warmbytes = WARMBYTES;
+
+static volatile sig_atomic_t active = 0;	/* connections being served */
+static volatile sig_atomic_t upgrade = 0;	/* SIGHUP or SIGUSR2 seen */
+static volatile sig_atomic_t dumptrace = 0;	/* SIGUSR1 seen */
+static volatile pid_t upgrade_pid = -1;
+
 void
 usage(void)
 {
-    (void)printf("usage: sws [-dh] [-c dir] [-i address] [-l file] [-p port] dir\n");
+    (void)printf("usage: sws [-dh] [-a cidr] [-b bytes] [-c dir] [-i address] [-l file]\n"
+	"           [-o option[,option...]] [-p port] [-r rate[:burst]] dir\n");
 }
 
 void
@@ -79,7 +134,8 @@ logRequest(int logfd, const char *request, const char *rip,
     strftime(time, TIMEBUFSIZ, "%Y-%m-%dT%H:%M:%SZ", gmtime_now);
 
     /* get only first line of request */
-    while (request[i] != '\r') {
+    while (request[i] && request[i] != '\r' && request[i] != '\n' &&
+	i < BUFSIZ - 1) {
         line[i] = request[i];
         i++;
     }
@@ -95,38 +151,6 @@ logRequest(int logfd, const char *request, const char *rip,
     }
 }
 
-/*
- * create a socket, then bind and listen.
- * loop through the addresses in info until a valid one is found.
- * return values:
- *  -1: no socket was found
- *  >0: the socket
- */
-int
-createSocket(struct addrinfo *info)
-{
-    int sock = -1;
-    struct addrinfo *p;
-
-    for (p = info; p != NULL; p = p->ai_next) {
-        if ((sock = socket(p->ai_family, SOCK_STREAM, 0)) == -1) {
-            continue;
-        }
-
-        if (bind(sock, p->ai_addr, p->ai_addrlen) == 0) {
-            if (listen(sock, MAXPENDING) < 0) {
-                perror("listen");
-                exit(EXIT_FAILURE);
-            }
-            break; /* found the address */
-        }
-
-        close(sock);
-    }
-
-    return sock;
-}
-
 static void
 formatDate(time_t t, char *buf, size_t buflen)
 {
@@ -135,25 +159,42 @@ formatDate(time_t t, char *buf, size_t buflen)
     strftime(buf, buflen, "%a, %d %b %Y %H:%M:%S GMT", &tm);
 }
 
-static const char *
-guess_mime_type(const char *path)
+/*
+ * loads the magic database.  Done once in the parent, every child then
+ * inherits it instead of loading it again.
+ * return values:
+ *  -1: no magic, everything will be application/octet-stream
+ *  0: success
+ */
+static int
+mimeInit(void)
 {
-    static magic_t magic_cookie = NULL;
+    if (magic_cookie) {
+	return 0;
+    }
 
+    magic_cookie = magic_open(MAGIC_MIME_TYPE);
     if (!magic_cookie) {
-	magic_cookie = magic_open(MAGIC_MIME_TYPE);
-	if (!magic_cookie) {
-	    return "application/octet-stream";
-	}
+	return -1;
+    }
 	
-	if (magic_load(magic_cookie, NULL) != 0) {
-	    magic_close(magic_cookie);
-	    magic_cookie = NULL;
-	    return "application/octet-stream";
-	}
+    if (magic_load(magic_cookie, NULL) != 0) {
+	magic_close(magic_cookie);
+	magic_cookie = NULL;
+	return -1;
+    }
+
+    return 0;
+}
+
+static const char *
+guess_mime_type(int fd)
+{
+    if (mimeInit() < 0) {
+	return "application/octet-stream";
     }
 
-    const char *mime = magic_file(magic_cookie, path);
+    const char *mime = magic_descriptor(magic_cookie, fd);
     if (!mime) {
 	return "application/octet-stream";
     }
@@ -162,86 +203,89 @@ guess_mime_type(const char *path)
 }
 
 /*
- * translates a requested URI into a filesystem path
+ * checks for a ".." path segment.  openat2(2) would stop it from leaving
+ * the base anyway; this keeps the realpath() fallback honest too.
+ */
+static int
+hasDotDot(const char *path)
+{
+    const char *p = path;
+
+    while ((p = strstr(p, "..")) != NULL) {
+	if ((p == path || p[-1] == '/') && (p[2] == '/' || p[2] == '\0')) {
+	    return 1;
+	}
+	p += 2;
+    }
+
+    return 0;
+}
+
+/*
+ * translates a decoded request path into an open file
  * 	- blocks ".." traversal
  * 	- resolves /cgi-bin paths
  * 	- resolves ~user paths
- * 	- makes sure paths stay inside docroot
+ * 	- makes sure paths stay inside docroot, ~user/sws or the CGI dir
  * 	- set flags
+ * the file is opened relative to the directory fds kept by the resolver,
+ * so there is no realpath() walk per request.  *fdp is -1 unless the
+ * path exists and is not a directory needing a slash; for a CGI script
+ * it is only good for fexecve().  outpath is the filesystem path, what
+ * the script is told it is.
  *
  * return values:
  *  0: sucess
  *  -1: error
  */
 int
-uriToPath(const char *docroot, const char *uri, char *outpath, 
-    size_t outsize, struct stat *statbuf, int *flags_out, const char *cgidir)
+uriToPath(const char *path, char **outpath, int *fdp, struct stat *statbuf,
+    int *flags_out, struct arena *arena)
 {   
-    char candidate[PATH_MAX];
-    char resolved[PATH_MAX];
-    char realroot[PATH_MAX];
+    const struct base *b;
+    struct base user;
+    const char *rel;
+    int fd;
 
-    if (!docroot || !uri || !outpath || outsize == 0) {
+    *flags_out = 0;
+    *fdp = -1;
+
+    if (!path || path[0] != '/') {
 	return -1;
     }
 
-    *flags_out = 0;
-
-    if (strstr(uri, "..") != NULL) {
+    if (hasDotDot(path)) {
 	errno = EACCES;
         return -1;
     }
     
-    if (cgidir && strncmp(uri, "/cgi-bin", 8) == 0) {
+    if ((b = resolverCgi()) != NULL && strncmp(path, "/cgi-bin", 8) == 0) {
 	*flags_out = FLAG_CGI;
 
-	const char *query = strchr(uri, '?');
-	size_t ulen;
-	if (query) {
-	    ulen = (size_t)(query - uri);
-	} else {
-	    ulen = strlen(uri);
+	rel = path + 8;
+	while (*rel == '/') {
+	    rel++;
 	}
 
-	char cleanuri[PATH_MAX];
-	memcpy(cleanuri, uri, ulen);
-	cleanuri[ulen] = '\0';
-
-	const char *rest = cleanuri + 8;
-	if (*rest == '\0') {
-	    rest = "/";
-	}
-
-	if (snprintf(candidate, sizeof(candidate), "%s%s", cgidir, rest) >= 
-	    (int)sizeof(candidate)) {
-	    perror("snprintf");
+	if ((*outpath = arenaPrintf(arena, "%s/%s", b->path, rel)) == NULL) {
 	    return -1;
 	}
 
-	if (realpath(candidate, resolved) == NULL) {
-	    perror("realpath");
-	    strncpy(outpath, candidate, outsize);
-	    outpath[outsize - 1] = '\0';
+	if ((fd = resolveOpen(b, rel, CGIOPEN, arena)) < 0) {
+	    return errno == EACCES ? -1 : 0;
+	}
+	if (fstat(fd, statbuf) < 0) {
+	    (void)close(fd);
 	    return 0;
 	}
+	*flags_out |= FLAG_EXISTS;
+	*fdp = fd; /* exec'd through, the path may change under us */
 
-	strncpy(outpath, resolved, outsize);
-	outpath[outsize - 1] = '\0';
-
-	if (stat(outpath, statbuf) == 0) {
-	    *flags_out |= FLAG_EXISTS;
-	}
-	
 	return 0;
     }
 
-    if (realpath(docroot, realroot) == NULL) {
-	perror("realpath");
-	return -1;
-    }
-
-    if (uri[0] == '/' && uri[1] == '~') {
-	const char *ptr = uri + 2;
+    if (path[1] == '~') {
+	const char *ptr = path + 2;
 	size_t uname_len = 0;
 	while (*ptr && *ptr != '/' && uname_len < MAXUSERNAME) {
 	    uname_len++;
@@ -254,126 +298,306 @@ uriToPath(const char *docroot, const char *uri, char *outpath,
 	}
 	
 	char uname[MAXUSERNAME + 1];
-	memcpy(uname, uri + 2, uname_len);
+	memcpy(uname, path + 2, uname_len);
 	uname[uname_len] = '\0';
 
-	struct passwd *pw = getpwnam(uname);
-	if (!pw) {
-	    perror("getpwnam");
-	    errno = EACCES;
+	if (userBase(uname, &user, arena) < 0) {
 	    return -1;
 	}
-
-	const char *rest = uri + 2 + uname_len;
-	if (rest[0] == '\0') {
-	    if (snprintf(candidate, sizeof(candidate), "%s/sws", pw->pw_dir) >= 
-		(int)sizeof(candidate)) {
-		perror("snprintf");
-		return -1;
-	    }
-	} else {
-	    if (snprintf(candidate, sizeof(candidate), "%s/sws%s", pw->pw_dir, rest) >= 
-		(int)sizeof(candidate)) {
-		perror("snprintf");
-		return -1;
-	    }
-	}
+	b = &user;
+	rel = path + 2 + uname_len;
     } else {
-	if (uri[0] != '/') {
-	    return -1;
-	}
+	b = resolverRoot();
+	rel = path;
+    }
 
-	if (snprintf(candidate, sizeof(candidate), "%s%s", docroot, uri) >= 
-	    (int)sizeof(candidate)) {
-	    perror("snprintf");
-    	    return -1;
-	}
+    while (*rel == '/') {
+	rel++;
     }
 
-    if (realpath(candidate, resolved) == NULL) {
-	strncpy(outpath, candidate, outsize);
-	outpath[outsize - 1] = '\0';
-	return 0;
+    if ((*outpath = arenaPrintf(arena, "%s/%s", b->path, rel)) == NULL) {
+	goto fail;
     }
 
-    size_t rootlen = strlen(realroot);
-    if (strncmp(resolved, realroot, rootlen) != 0 ||
-	(resolved[rootlen] != '/' && resolved[rootlen] != '\0')) {
-	errno = EACCES;
-	return -1;
+    if ((fd = resolveOpen(b, rel, O_RDONLY, arena)) < 0) {
+	if (errno == ENOENT || errno == ENOTDIR) {
+	    goto done;
+	}
+	goto fail;
     }
 
-    if (snprintf(outpath, outsize, "%s", resolved) >= (int)outsize) {
-	perror("snprintf");
-	return -1;
+    if (fstat(fd, statbuf) < 0) {
+	(void)close(fd);
+	goto fail;
     }
 
-    if (stat(outpath, statbuf) == 0) {
-	*flags_out |= FLAG_EXISTS;
-	if (S_ISDIR(statbuf->st_mode)) {
-	    *flags_out |= FLAG_DIR;
-	    size_t urilen = strlen(uri);
-	    if (uri[urilen-1] != '/') {
-		*flags_out |= FLAG_NEEDSLASH;
-		return 0;
-	    }
+    *flags_out |= FLAG_EXISTS;
+    if (S_ISDIR(statbuf->st_mode)) {
+	*flags_out |= FLAG_DIR;
+	size_t pathlen = strlen(path);
+	if (path[pathlen-1] != '/') {
+	    *flags_out |= FLAG_NEEDSLASH;
+	    (void)close(fd);
+	    goto done;
+	}
 	    
-	    char indexpath[PATH_MAX];
-	    if (snprintf(indexpath, sizeof(indexpath), "%s/index.html", outpath) >= 
-		(int)sizeof(indexpath)) {
-		perror("snprintf");
-		return -1;
-	    }
-	    if (stat(indexpath, statbuf) == 0) {
-		if (snprintf(outpath, outsize, "%s", indexpath) >= (int)outsize) {
-		    perror("snprintf");
-		    return -1;
-		}
+	char *indexrel;
+	struct stat isb;
+	int ifd;
+	if ((indexrel = arenaPrintf(arena, "%s%sindex.html", rel,
+	    *rel ? "/" : "")) == NULL) {
+	    (void)close(fd);
+	    goto fail;
+	}
+	if ((ifd = resolveOpen(b, indexrel, O_RDONLY, arena)) >= 0) {
+	    if (fstat(ifd, &isb) == 0 && !S_ISDIR(isb.st_mode)) {
+		(void)close(fd);
+		fd = ifd;
+		*statbuf = isb;
+		*outpath = arenaPrintf(arena, "%s/%s", b->path, indexrel);
 		*flags_out &= ~FLAG_DIR;
-		*flags_out |= FLAG_EXISTS;
+	    } else {
+		(void)close(ifd);
+	    }
+	}
+    }
+    *fdp = fd;
+
+done:
+    return 0;
+
+fail:
+    return -1;
+}
+
+/*
+ * waits up to seconds for fd to become readable; 0 only polls.
+ * return values:
+ *  1: readable, or the peer hung up
+ *  0: timed out
+ */
+static int
+readable(int fd, int seconds)
+{
+    struct pollfd pfd;
+    int n;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while ((n = poll(&pfd, 1, seconds * 1000)) < 0 && errno == EINTR) {
+	;
+    }
+
+    return n > 0;
+}
+
+/*
+ * reads until the blank line that ends the request header, appending to
+ * whatever the client pipelined behind the previous request.  A request
+ * that fills the buffer, or stalls for READTIMEOUT seconds, is handled
+ * as far as it got.
+ * return values:
+ *  -1: read error
+ *  0: the client closed, or went quiet, without sending anything
+ *  >0: length of the request at the front of c->in
+ */
+static ssize_t
+readRequest(struct connection *c)
+{
+    char *end;
+    ssize_t rd;
+
+    if (!c->in && (c->in = malloc(BUFSIZ)) == NULL) {
+	return -1;
+    }
+
+    for (;;) {
+	c->in[c->inlen] = '\0';
+	if ((end = strstr(c->in, "\r\n\r\n")) != NULL) {
+	    return end + 4 - c->in;
+	}
+	if (c->inlen == BUFSIZ - 1 || !readable(c->fd, READTIMEOUT)) {
+	    return c->inlen;
+	}
+	if ((rd = read(c->fd, c->in + c->inlen, BUFSIZ - 1 - c->inlen)) < 0) {
+	    if (errno == EINTR) {
+		continue;
 	    }
+	    return -1;
+	}
+	if (rd == 0) {
+	    return c->inlen;
+	}
+	c->inlen += rd;
+    }
+}
+
+/*
+ * finds the blank line that ends a CGI script's header block.
+ * return values:
+ *  0: not in buf (yet)
+ *  >0: offset of the body; *hdrlen is the length of the header lines,
+ *      up to and including the end of the last one
+ */
+static size_t
+cgiHeaderEnd(const char *buf, size_t len, size_t *hdrlen)
+{
+    size_t i;
+
+    *hdrlen = 0;
+    if (len > 0 && buf[0] == '\n') {
+	return 1;
+    }
+    if (len > 1 && buf[0] == '\r' && buf[1] == '\n') {
+	return 2;
+    }
+
+    for (i = 0; i < len; i++) {
+	if (buf[i] != '\n') {
+	    continue;
 	}
+	*hdrlen = i + 1;
+	if (i + 1 < len && buf[i + 1] == '\n') {
+	    return i + 2;
+	}
+	if (i + 2 < len && buf[i + 1] == '\r' && buf[i + 2] == '\n') {
+	    return i + 3;
+	}
+    }
+
+    *hdrlen = 0;
+    return 0;
+}
+
+/*
+ * checks whether the header lines in buf include name, e.g. "Content-Length:"
+ */
+static int
+cgiHasHeader(const char *buf, size_t len, const char *name)
+{
+    const char *p = buf, *end = buf + len, *nl;
+    size_t n = strlen(name);
+
+    while (p < end) {
+	if ((size_t)(end - p) > n && strncasecmp(p, name, n) == 0) {
+	    return 1;
+	}
+	if ((nl = memchr(p, '\n', end - p)) == NULL) {
+	    break;
+	}
+	p = nl + 1;
     }
+
     return 0;
 }
 
 /*
- * handles a single client TCP connection
- * 	- reads requests
+ * sends 103 Early Hints ahead of the real response so that the client
+ * can start on the subresources while we work.  Only HTTP/1.1 clients
+ * are sure to cope with a 1xx, and only a GET has anything to fetch.
+ */
+static void
+earlyHints(int fd, const struct request *req, const char *links,
+    struct arena *arena)
+{
+    char *hint;
+
+    if (!links || !req->http11 || strcmp(req->method, "GET") != 0) {
+	return;
+    }
+
+    if ((hint = arenaPrintf(arena, "HTTP/1.1 103 Early Hints\r\n%s\r\n",
+	links)) != NULL) {
+	(void)fsioSend(fd, hint, strlen(hint));
+    }
+}
+
+/*
+ * handles one request on a client TCP connection
+ * 	- reads the request
  * 	- parses method/URI
- * 	- generates HTTP responses
+ * 	- generates the HTTP response
+ * every buffer lives in the connection's arena.  Responses of unknown
+ * length (CGI output, directory indexes) are streamed, chunked if the
+ * client speaks HTTP/1.1.  Whatever the client sent after this request
+ * is left at the front of c->in.
+ * return values:
+ *  1: the response was framed and the client wants more, keep the connection
+ *  0: close the connection
  */
-void
-handleConnection(int fd, struct sockaddr_in6 client, const char *dir, int logfd, const char *cgidir)
+static int
+handleRequest(struct connection *c, int logfd)
 {
-    int rd, status;
+    int status, parsed, resolved, retry, docroot;
+    int fd = c->fd;
     int flags = 0;
     int wrote_direct = 0;
+    int keep = 0;
     int filefd = -1;
-    char request[BUFSIZ];
-    char header[BUFSIZ*2];
+    char *request;
+    char *header;
     char claddr[INET6_ADDRSTRLEN];
+    char next;
     char *response;
     const char *rip;
     const char *mime = NULL;
+    const char *links = NULL;
+    const char *proto = "HTTP/1.0";
+    const char *conn = "";
+    const struct packent *ent = NULL;
+    const struct packvar *var;
     struct request req;
+    struct writer w;
     size_t body_bytes = 0;
-    time_t time_now = time(NULL);
+    ssize_t reqlen;
+    time_t time_now;
+
+    uint64_t t0, started;
 
     memset(&req, 0, sizeof(req));
-    
-    if ((rd = read(fd, request, BUFSIZ-1)) <= 0) {
-        perror("reading stream message");
-        goto exit;
+
+    t0 = traceClock();
+    if ((reqlen = readRequest(c)) <= 0) {
+	if (reqlen < 0) {
+	    perror("reading stream message");
+	}
+	return 0;
     }
-    request[rd] = '\0';
+    traceEnd(PHASE_READ, t0);
+    started = scaleClock();
+    c->requests++;
+    time_now = time(NULL);
+
+    /* terminate this request, the next one may follow right behind */
+    request = c->in;
+    next = request[reqlen];
+    request[reqlen] = '\0';
 
-    if ((rip = inet_ntop(PF_INET6, &(client.sin6_addr), claddr, INET6_ADDRSTRLEN)) == NULL) {
+    if ((rip = inet_ntop(PF_INET6, &(c->client.sin6_addr), claddr, INET6_ADDRSTRLEN)) == NULL) {
         perror("inet_ntop");
         rip = "unkown";
     }
 
-    if (parseRequest(request, &req) != 0) {
+    if (!rateCheck(&c->client.sin6_addr, &retry)) {
+	status = 429;
+	if ((header = arenaPrintf(&c->arena,
+	    "HTTP/1.0 429 Too Many Requests\r\n"
+	    "Retry-After: %d\r\n"
+	    "Content-Type: text/plain\r\n"
+	    "Content-Length: 19\r\n\r\n"
+	    "Too Many Requests\r\n", retry)) == NULL) {
+	    goto internal_error;
+	}
+	response = header;
+	body_bytes = 19;
+	goto send_response;
+    }
+
+    t0 = traceClock();
+    parsed = parseRequest(request, &req, &c->arena);
+    traceEnd(PHASE_PARSE, t0);
+
+    if (parsed != 0) {
 	if (strcmp(req.method, "GET") != 0 && strcmp(req.method, "HEAD") != 0) {
 	    status = 501;
 	    response = "HTTP/1.0 501 Not Implemented\r\n"
@@ -393,71 +617,166 @@ handleConnection(int fd, struct sockaddr_in6 client, const char *dir, int logfd,
 	goto send_response;
     }
 
-    char fullpath[PATH_MAX];
+    /* only 1.1 clients get a persistent connection, and only while we frame */
+    if (req.http11) {
+	proto = "HTTP/1.1";
+	keep = !req.close && c->requests < KEEPALIVEMAX;
+	conn = keep ? "" : "Connection: close\r\n";
+    }
+
+    char *uri;
+    char *fullpath;
     struct stat sb;
+    char dateBuf[MAXDATE];
+    char lastModBuf[MAXDATE];
+
+    /* hits in a packed docroot need no filesystem or libmagic work at all */
+    t0 = traceClock();
+    docroot = req.path[1] != '~' &&
+	(resolverCgi() == NULL || strncmp(req.path, "/cgi-bin", 8) != 0);
+    if (docroot) {
+	ent = packFind(req.path);
+    }
+    if (ent && (var = packVariant(ent, req.gzip)) != NULL) {
+	traceEnd(PHASE_RESOLVE, t0);
+	formatDate(time_now, dateBuf, sizeof(dateBuf));
+
+	if (packNotModified(ent, var, &req)) {
+	    formatDate((time_t)ent->mtime, lastModBuf, sizeof(lastModBuf));
+	    status = 304;
+	    if ((header = arenaPrintf(&c->arena,
+		"%s 304 Not Modified\r\n"
+		"Date: %s\r\n"
+		"Server: sws/1.0\r\n"
+		"Last-Modified: %s\r\n"
+		"ETag: %s\r\n"
+		"%s"
+		"Content-Length: 0\r\n\r\n",
+		proto, dateBuf, lastModBuf, packData(var->etag), conn)) == NULL) {
+		goto internal_error;
+	    }
+	    response = header;
+	    body_bytes = 0;
+	    goto send_response;
+	}
+
+	status = 200;
+	if ((header = arenaPrintf(&c->arena,
+	    "%s 200 OK\r\n"
+	    "Date: %s\r\n"
+	    "%s%.*s\r\n",
+	    proto, dateBuf, conn, (int)var->headlen, packData(var->head))) == NULL) {
+	    goto internal_error;
+	}
+	body_bytes = var->bodylen;
+
+	t0 = traceClock();
+	if (fsioSend(fd, header, strlen(header)) < 0) {
+	    perror("send");
+	    keep = 0;
+	} else if (strcmp(req.method, "GET") == 0) {
+	    const char *p = packData(var->body);
+	    size_t off = 0;
+
+	    while (off < var->bodylen) {
+		size_t len = ratePace(&c->client.sin6_addr, var->bodylen - off);
+		if (fsioSend(fd, p + off, len) < 0) {
+		    keep = 0;
+		    break;
+		}
+		off += len;
+	    }
+	}
+	traceEnd(PHASE_SEND, t0);
+
+	response = header;
+	wrote_direct = 1;
+	goto send_response;
+    }
+
+    if ((uri = arenaStrndup(&c->arena, req.uri.ptr, req.query.ptr ?
+	(size_t)(req.query.ptr - 1 - req.uri.ptr) : req.uri.len)) == NULL) {
+	goto internal_error;
+    }
+
+    /*
+     * what is not in the index is not there, spare the filesystem; but
+     * ".." is refused before it could be told it is not found
+     */
+    t0 = traceClock();
+    if (docroot && !hasDotDot(req.path) && !docIndexMaybe(req.path)) {
+	traceEnd(PHASE_RESOLVE, t0);
+	goto not_found;
+    }
+    resolved = uriToPath(req.path, &fullpath, &filefd, &sb, &flags, &c->arena);
+    traceEnd(PHASE_RESOLVE, t0);
 
-    if (uriToPath(dir, req.uri, fullpath, sizeof(fullpath), &sb, &flags, cgidir) < 0) {
+    if (resolved < 0) {
 	status = 403;
 	response = "HTTP/1.0 403 Forbidden\r\n"
 	    "Content-Type: text/plain\r\n"
 	    "Content-Length: 11\r\n\r\n"
 	    "Forbidden\r\n";
 	body_bytes = 11;
+	keep = 0;
 	goto send_response;
     }
 
     if (!(flags & FLAG_EXISTS)) {
+	if (docroot) {
+	    docIndexMiss();
+	}
+not_found:
 	status = 404;
 	response = "HTTP/1.0 404 Not Found\r\n"
        	    "Content-Type: text/plain\r\n"
 	    "Content-Length: 11\r\n\r\n"
 	    "Not Found\r\n";
 	body_bytes = 11;
+	keep = 0;
 	goto send_response;
     }
 
     if (flags & FLAG_NEEDSLASH) {
-	char uri_with_slash[PATH_MAX+2];
-	size_t urilen = strlen(req.uri);
-
-	if (urilen > 0 && req.uri[urilen - 1] == '/') {
-	    snprintf(uri_with_slash, sizeof(uri_with_slash), "%s", req.uri);
-	} else {
-	    snprintf(uri_with_slash, sizeof(uri_with_slash), "%s/", req.uri);
-	}
+	size_t urilen = strlen(uri);
 
 	status = 301;
-	snprintf(header, sizeof(header), 
-	    "HTTP/1.0 301 Moved Permanently\r\n"
-	    "Location: %s\r\n"
+	if ((header = arenaPrintf(&c->arena,
+	    "%s 301 Moved Permanently\r\n"
+	    "Location: %s%s\r\n"
+	    "%s"
 	    "Content-Length: 0\r\n\r\n",
-	    uri_with_slash);
+	    proto, uri, (urilen > 0 && uri[urilen - 1] == '/') ? "" : "/",
+	    conn)) == NULL) {
+	    goto internal_error;
+	}
 	response = header;
 	body_bytes = 0;
 	goto send_response;
     }
 
-    char dateBuf[MAXDATE];
-    char lastModBuf[MAXDATE];
     if (req.ims_time > 0 && sb.st_mtime <= req.ims_time) {
 	formatDate(time_now, dateBuf, sizeof(dateBuf));
 	formatDate(sb.st_mtime, lastModBuf, sizeof(lastModBuf));
 
 	status = 304;
-	snprintf(header, sizeof(header),
-	    "HTTP/1.0 304 Not Modified\r\n"
+	if ((header = arenaPrintf(&c->arena,
+	    "%s 304 Not Modified\r\n"
 	    "Date: %s\r\n"
 	    "Server: sws/1.0\r\n"
 	    "Last-Modified: %s\r\n"
+	    "%s"
 	    "Content-Length: 0\r\n\r\n",
-	    dateBuf, lastModBuf);
+	    proto, dateBuf, lastModBuf, conn)) == NULL) {
+	    goto internal_error;
+	}
 	response = header;
 	body_bytes = 0;
 	goto send_response;
     }
 
     if ((flags & FLAG_DIR)) {
-	DIR *dirp = opendir(fullpath);
+	DIR *dirp = fdopendir(filefd);
     	if (!dirp) {
 	    status = 403;
 	    response = "HTTP/1.0 403 Forbidden\r\n"
@@ -465,127 +784,188 @@ handleConnection(int fd, struct sockaddr_in6 client, const char *dir, int logfd,
     		"Content-Length: 11\r\n\r\n"
 		"Forbidden\r\n";
 	    body_bytes = 11;
+	    keep = 0;
 	    goto send_response;
 	}
 
-	char body[8192]; /* fits 1-2 pages to avoid fragmentation*/
-	int body_len = snprintf(body, sizeof(body),
-	    "<html><head><title>Index of %s</title></head>"
-	    "<body><h1>Index of %s</h1><ul>", req.uri, req.uri);
-
-	struct dirent *dp;
-	while((dp = readdir(dirp)) != NULL) {
- 	    if (dp->d_name[0] == '.') {
-		continue;
-	    }
-	    body_len += snprintf(body + body_len, sizeof(body) - body_len,
-		"<li><a href=\"%s%s\">%s</a></li>",
-		req.uri, dp->d_name, dp->d_name);
-	}
-	closedir(dirp);
-
-	body_len += snprintf(body + body_len, sizeof(body) - body_len,
-	    "</ul></body></html>");
+	filefd = -1; /* closedir() closes it */
 
 	formatDate(time_now, dateBuf, sizeof(dateBuf));
 	formatDate(sb.st_mtime, lastModBuf, sizeof(lastModBuf));
 
+	/* the index is generated as it is sent, 1.0 clients read until close */
 	status = 200;
-	snprintf(header, sizeof(header),
-	    "HTTP/1.0 200 OK\r\n"
+	if ((header = arenaPrintf(&c->arena,
+	    "%s 200 OK\r\n"
 	    "Date: %s\r\n"
 	    "Server: sws/1.0\r\n"
 	    "Last-Modified: %s\r\n"
 	    "Content-Type: text/html\r\n"
-	    "Content-Length: %d\r\n\r\n",
-	    dateBuf, lastModBuf, body_len);
-	
-	write(fd, header, strlen(header));
+	    "%s%s\r\n",
+	    proto, dateBuf, lastModBuf, conn,
+	    req.http11 ? "Transfer-Encoding: chunked\r\n" : "")) == NULL ||
+	    writerInit(&w, fd, &c->client.sin6_addr, req.http11,
+	    strcmp(req.method, "GET") != 0, &c->arena) < 0) {
+	    closedir(dirp);
+	    goto internal_error;
+	}
+
+	t0 = traceClock();
+	if (fsioSend(fd, header, strlen(header)) < 0) {
+	    w.error = 1;
+	}
+
+	struct dirent *dp;
+	(void)writerPrintf(&w, "<html><head><title>Index of %s</title></head>"
+	    "<body><h1>Index of %s</h1><ul>", uri, uri);
+	while ((dp = readdir(dirp)) != NULL && !w.error) {
+ 	    if (dp->d_name[0] == '.') {
+		continue;
+	    }
+	    (void)writerPrintf(&w, "<li><a href=\"%s%s\">%s</a></li>",
+		uri, dp->d_name, dp->d_name);
+	}
+	closedir(dirp);
 
-	if (strcmp(req.method, "GET") == 0) {
-	    write(fd, body, body_len);
+	(void)writerPrintf(&w, "</ul></body></html>");
+	if (writerEnd(&w) < 0) {
+	    keep = 0;
 	}
+	traceEnd(PHASE_SEND, t0);
 
 	wrote_direct = 1;
 	response = header;
-	body_bytes = body_len;
+	body_bytes = w.body;
 	goto send_response;
     }
 
     if ((flags & FLAG_CGI)) {
+	char *cgi_buf;
 	int pipefd[2];
+
+	if ((cgi_buf = arenaAlloc(&c->arena, BUFSIZ)) == NULL) {
+	    goto internal_error;
+	}
+
 	if (pipe(pipefd) < 0) {
-	    status = 500;
-	    response = "HTTP/1.0 500 Internal Server Error\r\n"
-		"Content-Length: 0\r\n\r\n";
-	    body_bytes = 0;
-	    goto send_response;
+	    goto internal_error;
 	}
 
+	/* the script may take a while, which is when a hint pays off most */
+	links = hintsFor(req.path, -1, NULL, &c->arena);
+	earlyHints(fd, &req, links, &c->arena);
+
+	t0 = traceClock();
 	pid_t pid = fork();
 	if (pid < 0) {
 	    close(pipefd[0]);
 	    close(pipefd[1]);
-	    status = 500;
-	    response = "HTTP/1.0 500 Internal Server Error\r\n"
-		"Content-Length: 0\r\n\r\n";
-	    body_bytes = 0;
-	    goto send_response;
+	    goto internal_error;
 	}
 
 	if (pid == 0) {
 	    close(pipefd[0]);
 
 	    setenv("REQUEST_METHOD", req.method, 1);
-	    setenv("SCRIPT_NAME", req.uri, 1);
-	    setenv("SERVER_PROTOCOL", "HTTP/1.0", 1);
+	    setenv("SCRIPT_NAME", uri, 1);
+	    setenv("SERVER_PROTOCOL", proto, 1);
 	    setenv("SERVER_SOFTWARE", "sws/1.0", 1);
 	    setenv("GATEWAY_INTERFACE", "CGI/1.1", 1);
 	    setenv("REMOTE_ADDR", rip, 1);
 
-	    char *qmark = strchr(req.uri, '?');
-	    if (qmark) {
-		setenv("QUERY_STRING", qmark + 1, 1);
-	    } else {
-		setenv("QUERY_STRING", "", 1);
-	    }
+	    char *query = arenaStrndup(&c->arena, req.query.ptr ? req.query.ptr : "",
+		req.query.len);
+	    setenv("QUERY_STRING", query ? query : "", 1);
 
 	    setenv("REDIRECT_STATUS", "200", 1);
 
 	    dup2(pipefd[1], STDOUT_FILENO);
 	    close(pipefd[1]);
 
-	    execl(fullpath, fullpath, NULL);
+	    /*
+	     * exec what was resolved beneath the CGI dir, not whatever the
+	     * path names by now.  A #! interpreter opens it as /dev/fd/N,
+	     * so it has to survive the exec.
+	     */
+	    char *argv[] = { fullpath, NULL };
+	    (void)fcntl(filefd, F_SETFD, 0);
+	    fexecve(filefd, argv, environ);
 
 	    perror("exec");
 	    _exit(1);
 	}
 
 	close(pipefd[1]);
-	
-	formatDate(time_now, dateBuf, sizeof(dateBuf));
-	snprintf(header, sizeof(header),
-	    "HTTP/1.0 200 OK\r\n"
-	    "Date: %s\r\n"
-	    "Server: sws/1.0\r\n",
-	    dateBuf);
 
-	write(fd, header, strlen(header));
-	
-	char cgi_buf[BUFSIZ];
-	ssize_t n;
-	
+	/* ours can only be sent once the script's own header block is in */
+	ssize_t n = 0;
 	ssize_t cgi_total = 0;
-	while ((n = read(pipefd[0], cgi_buf, sizeof(cgi_buf))) > 0) {
+	size_t hdrlen = 0, bodyoff = 0, off;
+	int chunked, framed;
+
+	while (cgi_total < BUFSIZ &&
+	    (n = read(pipefd[0], cgi_buf + cgi_total, BUFSIZ - cgi_total)) > 0) {
 	    cgi_total += n;
-	    if (strcmp(req.method, "GET") == 0) {
-                write(fd, cgi_buf, n);
+	    if ((bodyoff = cgiHeaderEnd(cgi_buf, cgi_total, &hdrlen)) > 0) {
+		break;
 	    }
 	}
-	body_bytes = cgi_total;
 
-	close(pipefd[0]);
-	waitpid(pid, NULL, 0);
+	/*
+	 * a script that sets its own length is trusted with it; otherwise
+	 * 1.1 clients get chunks.  Output without a header block is passed
+	 * through as is, and only the close can end it.
+	 */
+	framed = bodyoff > 0 && cgiHasHeader(cgi_buf, hdrlen, "Content-Length:");
+	chunked = req.http11 && bodyoff > 0 && !framed;
+	if (!framed && !chunked) {
+	    keep = 0;
+	}
+	if (req.http11 && !keep) {
+	    conn = "Connection: close\r\n";
+	}
+
+	formatDate(time_now, dateBuf, sizeof(dateBuf));
+	if ((header = arenaPrintf(&c->arena,
+	    "%s 200 OK\r\n"
+	    "Date: %s\r\n"
+	    "Server: sws/1.0\r\n"
+	    "%s%s%s%.*s%s",
+	    proto, dateBuf, links ? links : "", conn,
+	    chunked ? "Transfer-Encoding: chunked\r\n" : "", (int)hdrlen, cgi_buf, bodyoff > 0 ? "\r\n" : "")) == NULL ||
+	    writerInit(&w, fd, &c->client.sin6_addr, chunked,
+	    strcmp(req.method, "GET") != 0, &c->arena) < 0) {
+	    close(pipefd[0]);
+	    waitpid(pid, NULL, 0);
+	    goto internal_error;
+	}
+
+	if (fsioSend(fd, header, strlen(header)) < 0) {
+	    w.error = 1;
+	}
+
+	/* coalesce while the script keeps writing, flush when it pauses */
+	off = bodyoff;
+	n = cgi_total - bodyoff;
+	while (!w.error) {
+	    if (writerPut(&w, cgi_buf + off, n) < 0 ||
+		(!readable(pipefd[0], 0) && writerFlush(&w) < 0)) {
+		break;
+	    }
+	    if ((n = read(pipefd[0], cgi_buf, BUFSIZ)) <= 0) {
+		break;
+	    }
+	    cgi_total += n;
+	    off = 0;
+	}
+	if (writerEnd(&w) < 0) {
+	    keep = 0;
+	}
+	body_bytes = cgi_total;
+
+	close(pipefd[0]);
+	waitpid(pid, NULL, 0);
+	traceEnd(PHASE_CGI, t0);
 
 	status = 200;
 	wrote_direct = 1;
@@ -594,126 +974,611 @@ handleConnection(int fd, struct sockaddr_in6 client, const char *dir, int logfd,
     }
 
 
-    filefd = open(fullpath, O_RDONLY);
-    if (filefd < 0) {
-	status = 403;
-	response = "HTTP/1.0 403 Forbidden\r\n"
-	    "Content-Type: text/plain\r\n"
-     	    "Content-Length: 11\r\n\r\n"
-	    "Forbidden\r\n";
-	body_bytes = 11;
-	goto send_response;
-    }
-
     formatDate(time_now, dateBuf, sizeof(dateBuf));
     formatDate(sb.st_mtime, lastModBuf, sizeof(lastModBuf));
-    mime = guess_mime_type(fullpath);
+    t0 = traceClock();
+    mime = guess_mime_type(filefd);
+    traceEnd(PHASE_MIME, t0);
+
+    if (strcmp(mime, "text/html") == 0) {
+	links = hintsFor(req.path, filefd, &sb, &c->arena);
+	earlyHints(fd, &req, links, &c->arena);
+    }
 
     status = 200;
-    snprintf(header, sizeof(header),
-	"HTTP/1.0 200 OK\r\n"
+    if ((header = arenaPrintf(&c->arena,
+	"%s 200 OK\r\n"
 	"Date: %s\r\n"
 	"Server: sws/1.0\r\n"
 	"Last-Modified: %s\r\n"
 	"Content-Type: %s\r\n"
+	"%s%s"
 	"Content-Length: %jd\r\n\r\n",
-	dateBuf, lastModBuf, mime, (intmax_t)sb.st_size);
+	proto, dateBuf, lastModBuf, mime, links ? links : "", conn,
+	(intmax_t)sb.st_size)) == NULL) {
+	goto internal_error;
+    }
     body_bytes = sb.st_size;
 
-    write(fd, header, strlen(header));
-
-    if (strcmp(req.method, "GET") == 0) {
-	char buf[BUFSIZ];
-	ssize_t n;
-	while ((n = read(filefd, buf, sizeof(buf))) > 0) {
-	    write(fd, buf, n);
+    t0 = traceClock();
+    if (fsioSend(fd, header, strlen(header)) < 0) {
+	perror("send");
+	keep = 0;
+    } else if (strcmp(req.method, "GET") == 0) {
+	off_t off = 0;
+	while (off < sb.st_size) {
+	    /* unshaped, this is a single call covering the whole file */
+	    size_t len = ratePace(&c->client.sin6_addr, sb.st_size - off);
+	    ssize_t n = fsioSendFile(fd, filefd, off, len);
+
+	    if (n < 0) {
+		perror("fsioSendFile");
+	    }
+	    if (n < 0 || (size_t)n < len) {
+		/*
+		 * the file shrank under us; Content-Length is out, so only
+		 * closing tells the client the body is short
+		 */
+		keep = 0;
+		break;
+	    }
+	    off += len;
 	}
     }
+    traceEnd(PHASE_SEND, t0);
 
     if (close(filefd) < 0) {
 	perror("close");
 	exit(EXIT_FAILURE);
     }
+    filefd = -1;
     response = header;
     wrote_direct = 1;
+    goto send_response;
+
+internal_error:
+    status = 500;
+    response = "HTTP/1.0 500 Internal Server Error\r\n"
+	"Content-Length: 0\r\n\r\n";
+    body_bytes = 0;
+    keep = 0;
 
 send_response:
     if (!wrote_direct && response) {
         if (write(fd, response, strlen(response)) < 0) {
 	    perror("write");
+	    keep = 0;
         }
     }
 
     if (logfd >= 0) {
 	logRequest(logfd, request, rip, time_now, status, body_bytes);
     }
+    scaleRecord(started);
 
-exit:
-    if (close(fd) < 0) {
-        perror("close");
-        exit(EXIT_FAILURE);
+    if (filefd >= 0) {
+	(void)close(filefd);
     }
-    return;
-    /* NOTREACHED */
+
+    if (keep) {
+	request[reqlen] = next;
+	c->inlen -= reqlen;
+	memmove(c->in, c->in + reqlen, c->inlen);
+    }
+
+    return keep;
 }
 
+/*
+ * waits up to KEEPALIVE seconds for the next request on a kept
+ * connection.  With a worker limit the wait is counted as idle and cut
+ * short when the parent needs the room.
+ * return values:
+ *  1: a request is coming
+ *  0: hang up
+ */
+static int
+keepWait(int fd)
+{
+    int i, ready = 0;
+
+    if (!scaleLimit()) {
+	return readable(fd, KEEPALIVE);
+    }
+
+    scaleIdle(1);
+    for (i = 0; i < KEEPALIVE && !ready && !scaleShed(); i++) {
+	ready = readable(fd, 1);
+    }
+    scaleIdle(0);
+
+    return ready;
+}
+
+/*
+ * serves requests on a client TCP connection until the client is done,
+ * a response could not be framed or the connection sat idle for
+ * KEEPALIVE seconds.  While idle it holds no request memory at all.
+ */
 void
-handleSocket(int sock, const char *dir, int logfd, const char *cgidir)
+handleConnection(struct connection *c, int logfd)
 {
-    int fd;
-    pid_t pid;
-    struct sockaddr_in6 client;
-    socklen_t length;
+    traceConnection(c->id);
 
-    memset(&client, 0, sizeof(client));
+    while (handleRequest(c, logfd)) {
+	arenaReset(&c->arena);
+	if (c->inlen > 0) {
+	    continue; /* pipelined, already here */
+	}
 
-    length = sizeof(client);
-    if ((fd = accept(sock, (struct sockaddr *)&client, &length)) < 0) {
-        perror("accept");
-        return;
+	free(c->in);
+	c->in = NULL;
+	arenaFree(&c->arena);
+	if (!keepWait(c->fd)) {
+	    break;
+	}
     }
 
-    if ((pid = fork()) < 0) {
-        perror("fork");
-        exit(EXIT_FAILURE);
-    } else if (pid == 0) { /* child */
-        handleConnection(fd, client, dir, logfd, cgidir);
-	_exit(EXIT_SUCCESS);
+    free(c->in);
+    c->in = NULL;
+    c->inlen = 0;
+
+    if (c->arena.peak > c->peak) {
+	c->peak = c->arena.peak;
     }
+    arenaFree(&c->arena);
 
-    /* parent returns */
-    if (close(fd) < 0) {
+    if (close(c->fd) < 0) {
         perror("close");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * reports what a connection cost in memory: the connection object itself
+ * plus the most arena any of its requests needed.
+ */
+static void
+reportConnection(const struct connection *c)
+{
+    (void)fprintf(stderr, "sws: connection served %u request(s), "
+	"%zu bytes peak (%zu connection + %zu arena)\n",
+	c->requests, sizeof(*c) + c->peak, sizeof(*c), c->peak);
+}
+
+/*
+ * an IPv4 listener fills in a sockaddr_in; turn it into the v4-mapped
+ * form so that every client address can be treated as IPv6.
+ */
+static void
+normalizeClient(struct sockaddr_in6 *client)
+{
+    struct sockaddr_in v4;
+
+    if (client->sin6_family != AF_INET) {
+	return;
+    }
+
+    memcpy(&v4, client, sizeof(v4));
+    memset(client, 0, sizeof(*client));
+    client->sin6_family = AF_INET6;
+    client->sin6_port = v4.sin_port;
+    client->sin6_addr.s6_addr[10] = 0xff;
+    client->sin6_addr.s6_addr[11] = 0xff;
+    memcpy(&client->sin6_addr.s6_addr[12], &v4.sin_addr, 4);
+}
+
+/*
+ * accepts every pending connection on sock, up to ACCEPTBATCH, and forks
+ * a child for each.  The listener is non-blocking, so this stops as soon
+ * as the backlog is empty.
+ */
+void
+handleSocket(int sock, int logfd)
+{
+    static unsigned long nextid = 0;
+    pid_t pid;
+    struct connection *c;
+    sigset_t chld, old;
+    int i;
+
+    (void)sigemptyset(&chld);
+    (void)sigaddset(&chld, SIGCHLD);
+
+    for (i = 0; i < ACCEPTBATCH; i++) {
+	if (!scaleAdmit(active)) {
+	    return; /* the rest wait in the accept queue */
+	}
+	if ((c = poolGet(&connpool)) == NULL) {
+	    perror("poolGet");
+	    return;
+	}
+	memset(c, 0, sizeof(*c));
+	arenaInit(&c->arena);
+	c->id = ++nextid;
+
+	if ((c->fd = listenAccept(sock, &c->client)) < 0) {
+	    if (errno != EAGAIN && errno != EINTR) {
+		perror("accept");
+	    }
+	    poolPut(&connpool, c);
+	    return;
+	}
+	normalizeClient(&c->client);
+
+	if ((pid = fork()) < 0) {
+	    perror("fork");
+	    exit(EXIT_FAILURE);
+	} else if (pid == 0) { /* child */
+	    handleConnection(c, logfd);
+	    if (verbose) {
+		reportConnection(c);
+	    }
+	    _exit(EXIT_SUCCESS);
+	}
+
+	/*
+	 * parent carries on with the next one.  reap() decrements active
+	 * from the SIGCHLD handler, a signal in the middle of the increment
+	 * would lose that and admission would stop for good.
+	 */
+	(void)sigprocmask(SIG_BLOCK, &chld, &old);
+	active++;
+	(void)sigprocmask(SIG_SETMASK, &old, NULL);
+	if (close(c->fd) < 0) {
+	    perror("close");
+	}
+	poolPut(&connpool, c);
     }
 }
 
 void
 reap(int signo)
 {
+    int saved = errno;
+    pid_t pid;
+
     (void)signo; /* silence unused warning */
-    wait(NULL);
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+	if (pid != upgrade_pid) {
+	    active--;
+	    scaleReap(pid);
+	}
+    }
+    errno = saved;
+}
+
+/*
+ * parses a byte count with an optional k, m or g suffix.
+ * return values:
+ *  -1: not a number
+ *  otherwise: the number of bytes
+ */
+static double
+parseSize(const char *str)
+{
+    char *end;
+    double n = strtod(str, &end);
+
+    switch (*end) {
+    case 'g': case 'G':
+	n *= 1024;
+	/* FALLTHROUGH */
+    case 'm': case 'M':
+	n *= 1024;
+	/* FALLTHROUGH */
+    case 'k': case 'K':
+	n *= 1024;
+	end++;
+	break;
+    }
+
+    return *end == '\0' ? n : -1;
+}
+
+/*
+ * parses the comma separated name=value list given to -o.
+ * return values:
+ *  -1: unknown option or missing value
+ *  0: success
+ */
+static int
+parseOptions(char *opts)
+{
+    enum { BACKLOG, DEFER, FASTOPEN, HINTFILE, HINTS, INDEX, P99, PACK,
+	RCVBUF, SNDBUF, TRACE, TRACEFILE, WARM, WARMMEM, WARMSECS, WORKERS };
+    char *const tokens[] = {
+	[BACKLOG] = "backlog",
+	[DEFER] = "defer",
+	[FASTOPEN] = "fastopen",
+	[HINTFILE] = "hintfile",
+	[HINTS] = "hints",
+	[INDEX] = "index",
+	[P99] = "p99",
+	[PACK] = "pack",
+	[RCVBUF] = "rcvbuf",
+	[SNDBUF] = "sndbuf",
+	[TRACE] = "trace",
+	[TRACEFILE] = "tracefile",
+	[WARM] = "warm",
+	[WARMMEM] = "warmbytes",
+	[WARMSECS] = "warmtime",
+	[WORKERS] = "workers",
+	NULL
+    };
+    char *value, *end;
+
+    while (*opts) {
+	int opt = getsubopt(&opts, tokens, &value);
+	double n = 0;
+
+	if (opt < 0 || !value || *value == '\0') {
+	    return -1;
+	}
+	if (opt != TRACEFILE && opt != PACK && opt != HINTFILE && opt != WORKERS &&
+	    (n = parseSize(value)) < 0) {
+	    return -1;
+	}
+
+	switch (opt) {
+	case BACKLOG:
+	    listenopts.backlog = (int)n;
+	    break;
+	case DEFER:
+	    listenopts.defer = (int)n;
+	    break;
+	case FASTOPEN:
+	    listenopts.fastopen = (int)n;
+	    break;
+	case HINTFILE:
+	    hintfile = value;
+	    break;
+	case HINTS:
+	    hintscan = (int)n;
+	    break;
+	case INDEX:
+	    docindex = (int)n;
+	    break;
+	case P99:
+	    p99target = (unsigned)n;
+	    break;
+	case PACK:
+	    packfile = value;
+	    break;
+	case RCVBUF:
+	    listenopts.rcvbuf = (int)n;
+	    break;
+	case SNDBUF:
+	    listenopts.sndbuf = (int)n;
+	    break;
+	case TRACE:
+	    tracesample = (unsigned)n;
+	    break;
+	case TRACEFILE:
+	    tracefile = value;
+	    break;
+	case WARM:
+	    warmtop = (int)n;
+	    break;
+	case WARMMEM:
+	    warmbytes = (size_t)n;
+	    break;
+	case WARMSECS:
+	    warmtime = n;
+	    break;
+	case WORKERS: /* min:max */
+	    minworkers = (int)strtol(value, &end, 10);
+	    if (*end != ':' || minworkers < 1) {
+		return -1;
+	    }
+	    maxworkers = (int)strtol(end + 1, &end, 10);
+	    if (*end != '\0' || maxworkers < minworkers) {
+		return -1;
+	    }
+	    break;
+	}
+    }
+
+    return 0;
+}
+
+static void
+requestUpgrade(int signo)
+{
+    (void)signo;
+    upgrade = 1;
+}
+
+static void
+requestTrace(int signo)
+{
+    (void)signo;
+    dumptrace = 1;
+}
+
+/*
+ * writes the trace ring out, to tracefile or /tmp/sws-trace.<pid>.json
+ */
+static void
+writeTrace(void)
+{
+    char path[PATH_MAX];
+    int n;
+
+    if (tracefile) {
+	(void)snprintf(path, sizeof(path), "%s", tracefile);
+    } else {
+	(void)snprintf(path, sizeof(path), "/tmp/sws-trace.%d.json", (int)getpid());
+    }
+
+    if ((n = traceDump(path)) < 0) {
+	perror(path);
+    } else if (verbose) {
+	(void)fprintf(stderr, "sws: wrote %d trace events to %s\n", n, path);
+    }
+}
+
+/*
+ * does what a request for uri would: resolves it, runs libmagic over the
+ * file, scans it for hints and has the kernel read it in, as far as
+ * *budget bytes allow.
+ * return values:
+ *  1: warmed
+ *  0: not there, or nothing to warm
+ */
+static int
+warmPath(const char *uri, size_t *budget, struct arena *arena)
+{
+    struct slice s, query;
+    struct stat sb;
+    char *path, *fullpath;
+    const char *mime;
+    int fd, flags;
+    size_t len;
+
+    s.ptr = uri;
+    s.len = strlen(uri);
+    if ((path = decodeUri(s, &query, arena)) == NULL ||
+	uriToPath(path, &fullpath, &fd, &sb, &flags, arena) < 0 ||
+	!(flags & FLAG_EXISTS)) {
+	return 0;
+    }
+    if (fd < 0 || (flags & (FLAG_CGI | FLAG_DIR))) {
+	if (fd >= 0) {
+	    (void)close(fd);
+	}
+	return flags & (FLAG_CGI | FLAG_DIR) ? 1 : 0; /* resolved, that is all */
+    }
+
+    mime = guess_mime_type(fd);
+    if (strcmp(mime, "text/html") == 0) {
+	(void)hintsFor(path, fd, &sb, arena);
+    }
+
+    len = (size_t)sb.st_size < *budget ? (size_t)sb.st_size : *budget;
+#ifdef POSIX_FADV_WILLNEED
+    if (len > 0) {
+	(void)posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+    }
+#endif
+    *budget -= len;
+
+    (void)close(fd);
+    return 1;
+}
+
+/*
+ * warms the warmtop most requested paths in the log open on fd, until
+ * warmtime seconds or warmbytes of file data are used up, and notes in
+ * the log how far it got.
+ */
+static void
+warmFromLog(int fd, int logfd)
+{
+    struct timespec start, now;
+    struct arena arena;
+    size_t budget = warmbytes;
+    char line[256];
+    char **top;
+    int i, warmed = 0, n;
+    double took = 0;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((top = warmRank(fd, warmtop)) == NULL) {
+	perror("warmRank");
+	return;
+    }
+
+    arenaInit(&arena);
+    for (i = 0; top[i] && budget > 0; i++) {
+	warmed += warmPath(top[i], &budget, &arena);
+	arenaReset(&arena);
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	took = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+	if (took >= warmtime) {
+	    i++;
+	    break;
+	}
+    }
+    arenaFree(&arena);
+    warmFree(top);
+
+    n = snprintf(line, sizeof(line), "# warmed %d of %d paths, %zu bytes, "
+	"in %.2fs\n", warmed, i, warmbytes - budget, took);
+    if (logfd >= 0 && n > 0 && write(logfd, line, n) < 0) {
+	perror("write");
+    }
+}
+
+/*
+ * gets everything a request might need loaded before the first accept,
+ * so that children inherit it warm and a restart has no latency cliff.
+ * With -o warm=n, so are the n paths the log says are asked for most.
+ */
+static void
+warmCaches(int debug, int warmfd, int logfd)
+{
+    if (fsioProbe() == 0 && debug) {
+	(void)fprintf(stderr, "sws: io_uring unavailable, using %s file I/O\n",
+	    fsioBackend());
+    }
+
+    if (mimeInit() < 0 && debug) {
+	(void)fprintf(stderr, "sws: could not load magic database\n");
+    }
+
+    if (warmfd >= 0) {
+	warmFromLog(warmfd, logfd);
+	(void)close(warmfd);
+    }
 }
 
 int
 main(int argc, char **argv)
 {
-    char *cgidir = NULL, *dir = NULL, *logfile = NULL, *address = NULL, *port = "8080";
-    int ch, debug = 0, sock, logfd = -1;
-    struct addrinfo hints, *res;
+    char *cgidir = NULL, *dir = NULL, *logfile = NULL;
+    char *addresses[MAXLISTEN], *ports[MAXLISTEN];
+    int naddresses = 0, nports = 0, nsocks = 0, socks[MAXLISTEN];
+    int ch, debug = 0, logfd = -1, readyfd = -1, warmfd = -1, i, j;
+    double reqrate = 0, reqburst = 0, bwrate = 0;
+    char *end, *opts;
 
-    memset(&hints, 0, sizeof(hints));
+    if (signal(SIGCHLD, reap) == SIG_ERR) { /* reap child processes */
+        perror("signal");
+        exit(EXIT_FAILURE);
+    }
 
-    hints.ai_family = AF_UNSPEC; /* accept both ipv4 and ipv6 */
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE; /* wildcards */
+    if (signal(SIGHUP, requestUpgrade) == SIG_ERR ||
+	signal(SIGUSR2, requestUpgrade) == SIG_ERR) { /* re-exec in place */
+        perror("signal");
+        exit(EXIT_FAILURE);
+    }
 
-    if (signal(SIGCHLD, reap) == SIG_ERR) { /* reap child processes */
+    if (signal(SIGUSR1, requestTrace) == SIG_ERR) { /* dump the trace ring */
         perror("signal");
         exit(EXIT_FAILURE);
     }
 
-    while ((ch = getopt(argc, argv, ":dhc:i:l:p:")) != -1) {
+    if (upgradeInit(argv) < 0) {
+	perror("upgradeInit");
+	exit(EXIT_FAILURE);
+    }
+
+    while ((ch = getopt(argc, argv, ":dha:b:c:i:l:o:p:r:")) != -1) {
         switch (ch) {
+        case 'a':
+	    if (rateAllow(optarg) < 0) {
+		(void)fprintf(stderr, "sws: bad address range: %s\n", optarg);
+		exit(EXIT_FAILURE);
+	    }
+            break;
+        case 'b':
+	    if ((bwrate = parseSize(optarg)) <= 0) {
+		(void)fprintf(stderr, "sws: bad bandwidth: %s\n", optarg);
+		exit(EXIT_FAILURE);
+	    }
+            break;
         case 'd':
             debug = 1;
             break;
@@ -724,17 +1589,42 @@ main(int argc, char **argv)
             cgidir = optarg;
             break;
         case 'i':
-            address = optarg;
+	    if (naddresses == MAXLISTEN) {
+		(void)fprintf(stderr, "sws: too many addresses\n");
+		exit(EXIT_FAILURE);
+	    }
+            addresses[naddresses++] = optarg;
             break;
         case 'l':
             logfile = optarg;
-	    if ((logfd = open(logfile, O_WRONLY | O_APPEND | O_CREAT, 0664)) < 0) {
+	    if ((logfd = open(logfile, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0664)) < 0) {
 		perror("open");
 		exit(EXIT_FAILURE);
 	    }
             break;
+        case 'o':
+	    /* getsubopt() writes into its argument, keep argv intact for upgrades */
+	    if ((opts = strdup(optarg)) == NULL || parseOptions(opts) < 0) {
+		(void)fprintf(stderr, "sws: bad option: %s\n", optarg);
+		exit(EXIT_FAILURE);
+	    }
+            break;
         case 'p':
-            port = optarg;
+	    if (nports == MAXLISTEN) {
+		(void)fprintf(stderr, "sws: too many ports\n");
+		exit(EXIT_FAILURE);
+	    }
+            ports[nports++] = optarg;
+            break;
+        case 'r':
+	    reqrate = strtod(optarg, &end);
+	    if (*end == ':') {
+		reqburst = strtod(end + 1, &end);
+	    }
+	    if (reqrate <= 0 || reqburst < 0 || *end != '\0') {
+		(void)fprintf(stderr, "sws: bad rate: %s\n", optarg);
+		exit(EXIT_FAILURE);
+	    }
             break;
         case '?':
         case ':':
@@ -751,11 +1641,60 @@ main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
-    /* add error checking on directory */
     dir = argv[0];
 
+    if (rateInit(reqrate, reqburst, bwrate) < 0) {
+	perror("rateInit");
+	exit(EXIT_FAILURE);
+    }
+
+    if (traceInit(tracesample) < 0) {
+	perror("traceInit");
+	exit(EXIT_FAILURE);
+    }
+
+    if (maxworkers && scaleInit(minworkers, maxworkers, p99target) < 0) {
+	perror("scaleInit");
+	exit(EXIT_FAILURE);
+    }
+
+    /* before daemon(), so a relative dir still means something */
+    if (resolverInit(dir, cgidir) < 0) {
+	perror(dir);
+	exit(EXIT_FAILURE);
+    }
+
+    if (hintsInit(hintscan, hintfile) < 0) {
+	perror(hintfile ? hintfile : "hintsInit");
+	exit(EXIT_FAILURE);
+    }
+
+    /* opened before daemon() so a relative -l still works, read after it */
+    if (warmtop > 0 && logfile &&
+	(warmfd = open(logfile, O_RDONLY | O_CLOEXEC)) < 0) {
+	perror(logfile);
+    }
+
+    /* the whole tree is walked, so this takes a while on a big docroot */
+    if (docindex && docIndexInit(dir) < 0) {
+	perror(dir);
+	exit(EXIT_FAILURE);
+    }
+
+    /* only the header is read, this is fast whatever the archive holds */
+    if (packfile && packOpen(packfile) < 0) {
+	perror(packfile);
+	exit(EXIT_FAILURE);
+    }
+
+    /* handed over by the sws we replace, which already daemonized */
+    nsocks = inheritedListeners(socks, MAXLISTEN);
+    for (i = 0; i < nsocks; i++) {
+	(void)listenAdopt(socks[i]);
+    }
+
     if (!debug) {
-        if (daemon(0, 0) < 0) {
+        if (!nsocks && daemon(0, 0) < 0) {
             perror("daemon");
             exit(EXIT_FAILURE);
         }
@@ -766,34 +1705,115 @@ main(int argc, char **argv)
         logfd = STDOUT_FILENO;
     }
 
-    if (getaddrinfo(address, port, &hints, &res) != 0) {
-        perror("getaddrinfo");
-        exit(EXIT_FAILURE);
-    }
+    if (!nsocks) {
+	if (naddresses == 0) {
+	    addresses[naddresses++] = NULL; /* every address, v4 and v6 */
+	}
+	if (nports == 0) {
+	    ports[nports++] = "8080";
+	}
 
-    if ((sock = createSocket(res)) < 0) {
-        perror("createSocket");
-        exit(EXIT_FAILURE);
+	for (i = 0; i < naddresses; i++) {
+	    for (j = 0; j < nports; j++) {
+		int n = listenOn(addresses[i], ports[j], &listenopts,
+		    socks + nsocks, MAXLISTEN - nsocks);
+		if (n > 0) {
+		    nsocks += n;
+		}
+	    }
+	}
+
+	if (nsocks == 0) {
+	    (void)fprintf(stderr, "sws: nothing to listen on\n");
+	    exit(EXIT_FAILURE);
+	}
     }
 
-    freeaddrinfo(res);
+    verbose = debug;
+    poolInit(&connpool, sizeof(struct connection), CONNSLAB);
+
+    warmCaches(debug, warmfd, logfd);
+    docIndexReport(logfd);
+    upgradeReady();
 
     for (;;) {
         fd_set ready;
         struct timeval timeout;
+	int maxfd = -1, indexfd, indexing;
+
+	if (dumptrace) {
+	    dumptrace = 0;
+	    writeTrace();
+	    docIndexReport(logfd);
+	}
+	indexing = docIndexTick(time(NULL));
+	scaleTick(socks, nsocks, active, logfd);
+
+	if (upgrade && readyfd < 0) {
+	    upgrade = 0;
+	    if ((upgrade_pid = upgradeSpawn(socks, nsocks, &readyfd)) < 0) {
+		perror("upgradeSpawn");
+	    }
+	}
 
         FD_ZERO(&ready);
-        FD_SET(sock, &ready);
-        timeout.tv_sec = SLEEP;
+	for (i = 0; i < nsocks && scaleAdmit(active); i++) {
+	    FD_SET(socks[i], &ready);
+	    if (socks[i] > maxfd) {
+		maxfd = socks[i];
+	    }
+	}
+	if (readyfd >= 0) {
+	    FD_SET(readyfd, &ready);
+	    if (readyfd > maxfd) {
+		maxfd = readyfd;
+	    }
+	}
+	if ((indexfd = docIndexFd()) >= 0) {
+	    FD_SET(indexfd, &ready);
+	    if (indexfd > maxfd) {
+		maxfd = indexfd;
+	    }
+	}
+        timeout.tv_sec = indexing ? 0 : scaleLimit() ? SCALETICK : SLEEP;
         timeout.tv_usec = 0;
 
-        if (select(sock + 1, &ready, 0, 0, &timeout) < 0) {
+        if (select(maxfd + 1, &ready, 0, 0, &timeout) < 0) {
             if (errno != EINTR) {
                 perror("select");
             }
-        } else if (FD_ISSET(sock, &ready)) {
-            handleSocket(sock, dir, logfd, cgidir);
-        }
+	    continue;
+	}
+
+	if (readyfd >= 0 && FD_ISSET(readyfd, &ready)) {
+	    char byte;
+
+	    if (read(readyfd, &byte, 1) == 1) {
+		/* the new sws is accepting, stop and let it take over */
+		for (i = 0; i < nsocks; i++) {
+		    (void)close(socks[i]);
+		}
+		drain(&active, time(NULL) + DRAINTIME);
+		exit(EXIT_SUCCESS);
+	    }
+
+	    if (debug) {
+		(void)fprintf(stderr, "sws: upgrade failed, still serving\n");
+	    }
+	    (void)close(readyfd);
+	    readyfd = -1;
+	    upgrade_pid = -1;
+	}
+
+	if (indexfd >= 0 && FD_ISSET(indexfd, &ready)) {
+	    docIndexUpdate();
+	}
+
+	for (i = 0; i < nsocks; i++) {
+	    if (FD_ISSET(socks[i], &ready)) {
+		handleSocket(socks[i], logfd);
+	    }
+	}
     }
 
     (void)dir;
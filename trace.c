@@ -0,0 +1,197 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/*
+ * with systemtap's header around, every phase is also a USDT probe,
+ * sws:phase(phase, start_ns, duration_ns), for bpftrace and perf.  The
+ * probe has a semaphore, which tracers raise while they are attached, so
+ * that nobody pays for the clock otherwise.
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define HAVE_SDT 1
+#endif
+#endif
+
+#ifdef HAVE_SDT
+unsigned short sws_phase_semaphore __attribute__((unused))
+    __attribute__((section(".probes")));
+#define SWS_PHASE_ENABLED() __builtin_expect(sws_phase_semaphore, 0)
+#else
+#define SWS_PHASE_ENABLED() 0
+#endif
+
+struct event {
+    uint64_t seq;	/* slot index + 1, written last */
+    uint64_t start;	/* CLOCK_MONOTONIC, ns */
+    uint32_t dur;	/* ns */
+    uint32_t pid;
+    uint32_t conn;
+    uint32_t phase;
+};
+
+/* shared by all children, each reserves slots with one atomic add */
+struct ring {
+    uint64_t head;
+    struct event ev[TRACESLOTS];
+};
+
+static const char *names[PHASE_MAX] = {
+    [PHASE_READ] = "read",
+    [PHASE_PARSE] = "parse",
+    [PHASE_RESOLVE] = "resolve",
+    [PHASE_MIME] = "mime",
+    [PHASE_CGI] = "cgi",
+    [PHASE_SEND] = "send",
+};
+
+static struct ring *ring = NULL;
+static unsigned every = 0;
+static int sampled = 0;
+static uint32_t conn = 0;
+
+/*
+ * maps the trace ring.  1 in every connections is traced, 0 turns
+ * tracing off.
+ * return values:
+ *  -1: the ring could not be mapped
+ *  0: success
+ */
+int
+traceInit(unsigned sample)
+{
+    every = sample;
+    if (every == 0) {
+	return 0;
+    }
+
+    ring = mmap(NULL, sizeof(*ring), PROT_READ | PROT_WRITE,
+	MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+	ring = NULL;
+	every = 0;
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * called by the child serving connection id; decides whether it is sampled
+ */
+void
+traceConnection(unsigned long id)
+{
+    conn = (uint32_t)id;
+    sampled = ring != NULL && id % every == 0;
+}
+
+static uint64_t
+now(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * return values:
+ *  0: nobody is looking at this connection
+ *  otherwise: the start of a phase, to hand to traceEnd()
+ */
+uint64_t
+traceClock(void)
+{
+    if (!sampled && !SWS_PHASE_ENABLED()) {
+	return 0;
+    }
+    return now();
+}
+
+void
+traceEnd(enum phase phase, uint64_t start)
+{
+    struct event *e;
+    uint64_t end, seq;
+
+    if (start == 0) {
+	return;
+    }
+    end = now();
+
+#ifdef HAVE_SDT
+    DTRACE_PROBE3(sws, phase, (int)phase, start, end - start);
+#endif
+
+    if (!sampled) {
+	return;
+    }
+
+    seq = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    e = &ring->ev[seq & (TRACESLOTS - 1)];
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    e->start = start;
+    e->dur = (uint32_t)(end - start);
+    e->pid = (uint32_t)getpid();
+    e->conn = conn;
+    e->phase = phase;
+    __atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * writes the ring to path in Chrome's trace event format, for
+ * chrome://tracing or Perfetto.  Each pid is a worker, each tid the
+ * connection it served.
+ * return values:
+ *  -1: tracing is off or path could not be written
+ *  >=0: number of events written
+ */
+int
+traceDump(const char *path)
+{
+    uint64_t head, i, seq;
+    FILE *fp;
+    int n = 0;
+
+    if (!ring || (fp = fopen(path, "w")) == NULL) {
+	return -1;
+    }
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    i = head > TRACESLOTS ? head - TRACESLOTS : 0;
+
+    (void)fprintf(fp, "{\"traceEvents\":[");
+    for (; i < head; i++) {
+	struct event e = ring->ev[i & (TRACESLOTS - 1)];
+
+	seq = __atomic_load_n(&ring->ev[i & (TRACESLOTS - 1)].seq, __ATOMIC_ACQUIRE);
+	if (e.seq != i + 1 || seq != i + 1 || e.phase >= PHASE_MAX) {
+	    continue; /* still being written, or already overwritten */
+	}
+	(void)fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"sws\",\"ph\":\"X\","
+	    "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%u,\"tid\":%u}",
+	    n ? "," : "", names[e.phase], e.start / 1e3, e.dur / 1e3,
+	    e.pid, e.conn);
+	n++;
+    }
+    (void)fprintf(fp, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+    if (fclose(fp) != 0) {
+	return -1;
+    }
+
+    return n;
+}
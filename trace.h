@@ -0,0 +1,26 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+#ifndef TRACESLOTS
+#define TRACESLOTS 65536 /* events kept, oldest are overwritten (power of 2) */
+#endif
+
+enum phase {
+    PHASE_READ,
+    PHASE_PARSE,
+    PHASE_RESOLVE,
+    PHASE_MIME,
+    PHASE_CGI,
+    PHASE_SEND,
+    PHASE_MAX
+};
+
+int traceInit(unsigned);
+void traceConnection(unsigned long);
+uint64_t traceClock(void);
+void traceEnd(enum phase, uint64_t);
+int traceDump(const char *);
+
+#endif
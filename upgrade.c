@@ -0,0 +1,180 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "upgrade.h"
+
+static char **args = NULL;
+static char *self = NULL;
+static char *cwd = NULL;
+
+/*
+ * remembers how we were started, so the binary on disk can be run again
+ * with the same arguments from the same directory.  Must be called before
+ * daemon() changes directory.
+ * return values:
+ *  -1: out of memory
+ *  0: success
+ */
+int
+upgradeInit(char **argv)
+{
+    args = argv;
+
+    if (strchr(argv[0], '/') != NULL) {
+	self = realpath(argv[0], NULL);
+    } else {
+	self = strdup(argv[0]); /* found through PATH, execvp() will do it again */
+    }
+
+    if ((cwd = getcwd(NULL, 0)) == NULL || self == NULL) {
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * picks up the listening sockets handed over by the process we replace.
+ * return values:
+ *  0: nothing was inherited, bind as usual
+ *  >0: number of sockets stored in fds
+ */
+int
+inheritedListeners(int *fds, int max)
+{
+    const char *env = getenv(LISTENFDS_ENV);
+    char *end;
+    int n = 0;
+
+    if (!env) {
+	return 0;
+    }
+
+    while (*env && n < max) {
+	struct stat sb;
+	long fd = strtol(env, &end, 10);
+
+	if (end == env || fd < 0 || fd > INT_MAX || fstat((int)fd, &sb) < 0 ||
+	    !S_ISSOCK(sb.st_mode)) {
+	    break;
+	}
+	(void)fcntl((int)fd, F_SETFD, FD_CLOEXEC);
+	fds[n++] = (int)fd;
+
+	env = *end == ',' ? end + 1 : end;
+    }
+
+    (void)unsetenv(LISTENFDS_ENV); /* CGI scripts have no business with it */
+    return n;
+}
+
+/*
+ * tells the process we replace that we are warmed up and about to accept,
+ * so it can stop accepting and drain.  Does nothing on a normal start.
+ */
+void
+upgradeReady(void)
+{
+    const char *env = getenv(READYFD_ENV);
+    int fd;
+
+    if (!env) {
+	return;
+    }
+
+    fd = atoi(env);
+    if (write(fd, "1", 1) < 0) {
+	perror("write");
+    }
+    (void)close(fd);
+    (void)unsetenv(READYFD_ENV);
+}
+
+/*
+ * starts the binary on disk with our arguments and hands it the listening
+ * sockets.  The new process gets its own process group so that draining
+ * the old one never signals it.  *readyfd becomes readable when the new
+ * process is ready (one byte) or has died (EOF).
+ * return values:
+ *  -1: could not start the new process
+ *  >0: its pid
+ */
+pid_t
+upgradeSpawn(const int *fds, int nfds, int *readyfd)
+{
+    char env[MAXLISTEN * 12];
+    char ready[12];
+    size_t len = 0;
+    int p[2], i;
+    pid_t pid;
+
+    if (!self || pipe(p) < 0) {
+	return -1;
+    }
+
+    env[0] = '\0';
+    for (i = 0; i < nfds && i < MAXLISTEN; i++) {
+	len += snprintf(env + len, sizeof(env) - len, "%s%d", i ? "," : "", fds[i]);
+    }
+    (void)snprintf(ready, sizeof(ready), "%d", p[1]);
+
+    if ((pid = fork()) < 0) {
+	(void)close(p[0]);
+	(void)close(p[1]);
+	return -1;
+    }
+
+    if (pid == 0) {
+	(void)close(p[0]);
+	(void)setpgid(0, 0);
+	for (i = 0; i < nfds; i++) {
+	    (void)fcntl(fds[i], F_SETFD, 0);
+	}
+	if (setenv(LISTENFDS_ENV, env, 1) < 0 || setenv(READYFD_ENV, ready, 1) < 0 ||
+	    chdir(cwd) < 0) {
+	    _exit(127);
+	}
+	if (strchr(self, '/') != NULL) {
+	    execv(self, args);
+	} else {
+	    execvp(self, args);
+	}
+	perror("exec");
+	_exit(127);
+    }
+
+    (void)close(p[1]);
+    (void)fcntl(p[0], F_SETFD, FD_CLOEXEC);
+    *readyfd = p[0];
+
+    return pid;
+}
+
+/*
+ * waits until every in-flight connection (and with it any CGI script it
+ * runs) has finished, or until deadline.  Whatever is still running then
+ * is terminated, as long as we lead our own process group; in debug mode
+ * we share the shell's and leave the stragglers alone.
+ */
+void
+drain(volatile sig_atomic_t *active, time_t deadline)
+{
+    while (*active > 0 && time(NULL) < deadline) {
+	(void)sleep(1); /* SIGCHLD cuts this short */
+    }
+
+    if (*active > 0 && getpgrp() == getpid()) {
+	(void)signal(SIGTERM, SIG_IGN);
+	(void)killpg(getpgrp(), SIGTERM);
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef _UPGRADE_H_
+#define _UPGRADE_H_
+
+#include <sys/types.h>
+
+#include <signal.h>
+
+#ifndef DRAINTIME
+#define DRAINTIME 30 /* seconds the old process waits for in-flight requests */
+#endif
+
+#ifndef MAXLISTEN
+#define MAXLISTEN 16 /* listening sockets that can be handed over */
+#endif
+
+#define LISTENFDS_ENV "SWS_LISTEN_FDS"
+#define READYFD_ENV "SWS_READY_FD"
+
+int upgradeInit(char **);
+int inheritedListeners(int *, int);
+void upgradeReady(void);
+pid_t upgradeSpawn(const int *, int, int *);
+void drain(volatile sig_atomic_t *, time_t);
+
+#endif
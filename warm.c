@@ -0,0 +1,200 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "warm.h"
+
+struct count {
+    char *uri;
+    unsigned long n;
+};
+
+static uint32_t
+hash(const char *s, size_t len)
+{
+    uint32_t h = 0x811c9dc5;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+	h = (h ^ (unsigned char)s[i]) * 0x01000193;
+    }
+
+    return h;
+}
+
+/*
+ * counts one request for uri, unless the table is full and it is new
+ */
+static void
+countUri(struct count *tab, size_t *used, const char *uri, size_t len)
+{
+    uint32_t i = hash(uri, len) % WARMURIS;
+
+    while (tab[i].uri) {
+	if (strncmp(tab[i].uri, uri, len) == 0 && tab[i].uri[len] == '\0') {
+	    tab[i].n++;
+	    return;
+	}
+	i = (i + 1) % WARMURIS;
+    }
+
+    /* keep the table at most 3/4 full, so probes stay short */
+    if (*used >= WARMURIS / 4 * 3 || (tab[i].uri = strndup(uri, len)) == NULL) {
+	return;
+    }
+    tab[i].n = 1;
+    (*used)++;
+}
+
+/*
+ * picks the URI out of a log line written by logRequest():
+ *	rip time "METHOD uri PROTO" status bytes
+ * Only GET and HEAD requests answered 200 or 304 are worth warming.
+ * return values:
+ *  NULL: not such a request
+ *  otherwise: the uri, *len is its length
+ */
+static const char *
+parseLine(const char *line, const char *end, size_t *len)
+{
+    const char *open, *close, *uri, *sp, *query;
+    int status;
+
+    if (*line == '#' ||
+	(open = memchr(line, '"', end - line)) == NULL) {
+	return NULL;
+    }
+    for (close = end - 1; close > open && *close != '"'; close--) {
+	;
+    }
+    if (close == open) {
+	return NULL;
+    }
+
+    status = atoi(close + 1);
+    if (status != 200 && status != 304) {
+	return NULL;
+    }
+
+    if (strncmp(open + 1, "GET ", 4) == 0) {
+	uri = open + 5;
+    } else if (strncmp(open + 1, "HEAD ", 5) == 0) {
+	uri = open + 6;
+    } else {
+	return NULL;
+    }
+    if ((sp = memchr(uri, ' ', close - uri)) == NULL) {
+	sp = close; /* HTTP/0.9 */
+    }
+    if ((query = memchr(uri, '?', sp - uri)) != NULL) {
+	sp = query; /* the same file whatever the query */
+    }
+    if (sp == uri || *uri != '/') {
+	return NULL;
+    }
+
+    *len = sp - uri;
+    return uri;
+}
+
+static int
+byCount(const void *a, const void *b)
+{
+    const struct count *x = a, *y = b;
+
+    if (!x->uri || !y->uri) {
+	return !x->uri - !y->uri;
+    }
+    return x->n < y->n ? 1 : x->n > y->n ? -1 : 0;
+}
+
+/*
+ * ranks the URIs in the last WARMLOG bytes of the access log open on fd
+ * by how often they were served.
+ * return values:
+ *  NULL: the log could not be read
+ *  otherwise: up to n URIs as logged, most requested first, ending in
+ *  NULL; give it to warmFree()
+ */
+char **
+warmRank(int fd, int n)
+{
+    struct count *tab;
+    struct stat sb;
+    char *buf, *p, *end, *nl, **top;
+    size_t used = 0, len;
+    off_t off;
+    ssize_t got;
+    int i;
+
+    if (fstat(fd, &sb) < 0) {
+	return NULL;
+    }
+    off = sb.st_size > WARMLOG ? sb.st_size - WARMLOG : 0;
+    len = sb.st_size - off;
+
+    if ((buf = malloc(len + 1)) == NULL) {
+	return NULL;
+    }
+    if ((got = pread(fd, buf, len, off)) < 0) {
+	free(buf);
+	return NULL;
+    }
+    end = buf + got;
+
+    if ((tab = calloc(WARMURIS, sizeof(*tab))) == NULL) {
+	free(buf);
+	return NULL;
+    }
+
+    p = buf;
+    if (off > 0 && (p = memchr(buf, '\n', got)) != NULL) {
+	p++; /* started in the middle of a line */
+    }
+    for (; p && p < end; p = nl + 1) {
+	const char *uri;
+
+	if ((nl = memchr(p, '\n', end - p)) == NULL) {
+	    break; /* still being written */
+	}
+	if ((uri = parseLine(p, nl, &len)) != NULL) {
+	    countUri(tab, &used, uri, len);
+	}
+    }
+    free(buf);
+
+    qsort(tab, WARMURIS, sizeof(*tab), byCount);
+    if ((top = calloc(n + 1, sizeof(*top))) == NULL) {
+	for (i = 0; (size_t)i < used; i++) {
+	    free(tab[i].uri);
+	}
+	free(tab);
+	return NULL;
+    }
+    for (i = 0; (size_t)i < used; i++) {
+	if (i < n) {
+	    top[i] = tab[i].uri;
+	} else {
+	    free(tab[i].uri);
+	}
+    }
+    free(tab);
+
+    return top;
+}
+
+void
+warmFree(char **top)
+{
+    int i;
+
+    for (i = 0; top && top[i]; i++) {
+	free(top[i]);
+    }
+    free(top);
+}
@@ -0,0 +1,23 @@
+#ifndef _WARM_H_
+#define _WARM_H_
+
+#ifndef WARMLOG
+#define WARMLOG (16 * 1024 * 1024) /* bytes at the end of the log that are read */
+#endif
+
+#ifndef WARMURIS
+#define WARMURIS 65536 /* distinct URIs counted, later ones are ignored */
+#endif
+
+#ifndef WARMTIME
+#define WARMTIME 10 /* seconds warming may take by default */
+#endif
+
+#ifndef WARMBYTES
+#define WARMBYTES (64 * 1024 * 1024) /* file data read ahead by default */
+#endif
+
+char **warmRank(int, int);
+void warmFree(char **);
+
+#endif
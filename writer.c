@@ -0,0 +1,182 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fsio.h"
+#include "ratelimit.h"
+#include "writer.h"
+
+#define TRAILER 7 /* "\r\n" after a chunk plus the "0\r\n\r\n" that ends them */
+
+/*
+ * sets up a writer on fd, with its buffer taken from arena.
+ * return values:
+ *  -1: out of memory
+ *  0: success
+ */
+int
+writerInit(struct writer *w, int fd, const struct in6_addr *client, int chunked,
+    int discard, struct arena *arena)
+{
+    memset(w, 0, sizeof(*w));
+    w->fd = fd;
+    w->client = client;
+    w->chunked = chunked;
+    w->discard = discard;
+
+    if ((w->buf = arenaAlloc(arena, WRITEHEAD + WRITEBUF + TRAILER)) == NULL) {
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * sends what is buffered, framed as one chunk if chunked, and the
+ * terminating chunk too if last.  The size line is written into the
+ * room in front of the data so that the whole chunk is one send.
+ */
+static int
+emit(struct writer *w, int last)
+{
+    char *start = w->buf + WRITEHEAD;
+    char *end = start + w->len;
+    char size[WRITEHEAD];
+    int n;
+
+    if (w->error) {
+	return -1;
+    }
+
+    if (w->chunked) {
+	if (w->len > 0) {
+	    n = snprintf(size, sizeof(size), "%zx\r\n", w->len);
+	    start -= n;
+	    memcpy(start, size, n);
+	    memcpy(end, "\r\n", 2);
+	    end += 2;
+	}
+	if (last) {
+	    memcpy(end, "0\r\n\r\n", 5);
+	    end += 5;
+	}
+    }
+    w->len = 0;
+
+    if (w->discard) {
+	return 0;
+    }
+
+    while (start < end) {
+	size_t len = ratePace(w->client, end - start);
+
+	if (fsioSend(w->fd, start, len) < 0) {
+	    w->error = 1;
+	    return -1;
+	}
+	start += len;
+    }
+
+    return 0;
+}
+
+/*
+ * return values:
+ *  -1: the client went away
+ *  0: success
+ */
+int
+writerPut(struct writer *w, const void *p, size_t n)
+{
+    const char *src = p;
+
+    w->body += n;
+    while (n > 0) {
+	size_t room = WRITEBUF - w->len;
+
+	if (room == 0) {
+	    if (emit(w, 0) < 0) {
+		return -1;
+	    }
+	    continue;
+	}
+	if (room > n) {
+	    room = n;
+	}
+	memcpy(w->buf + WRITEHEAD + w->len, src, room);
+	w->len += room;
+	src += room;
+	n -= room;
+    }
+
+    return w->error ? -1 : 0;
+}
+
+/*
+ * formats straight into the buffer, flushing first if it does not fit.
+ * return values:
+ *  -1: the client went away, or out of memory
+ *  0: success
+ */
+int
+writerPrintf(struct writer *w, const char *fmt, ...)
+{
+    va_list ap, again;
+    char *tmp;
+    int n;
+
+    va_start(ap, fmt);
+    va_copy(again, ap);
+    /* the trailer room is free until emit(), so the NUL may land there */
+    n = vsnprintf(w->buf + WRITEHEAD + w->len, WRITEBUF - w->len + 1, fmt, ap);
+    va_end(ap);
+
+    if (n < 0) {
+	va_end(again);
+	return -1;
+    }
+
+    if ((size_t)n <= WRITEBUF - w->len) {
+	va_end(again);
+	w->len += n;
+	w->body += n;
+	return w->error ? -1 : 0;
+    }
+
+    if ((tmp = malloc(n + 1)) == NULL) {
+	va_end(again);
+	return -1;
+    }
+    (void)vsnprintf(tmp, n + 1, fmt, again);
+    va_end(again);
+
+    n = writerPut(w, tmp, n);
+    free(tmp);
+
+    return n;
+}
+
+/*
+ * sends whatever is buffered now, e.g. because the producer has nothing
+ * more ready and the client should not wait for a full buffer.
+ */
+int
+writerFlush(struct writer *w)
+{
+    if (w->len == 0) {
+	return w->error ? -1 : 0;
+    }
+
+    return emit(w, 0);
+}
+
+/*
+ * flushes and, if chunked, ends the body; the last chunk and the
+ * terminating one go out together.
+ */
+int
+writerEnd(struct writer *w)
+{
+    return emit(w, 1);
+}
@@ -0,0 +1,42 @@
+#ifndef _WRITER_H_
+#define _WRITER_H_
+
+#include <netinet/in.h>
+
+#include <stddef.h>
+
+#include "arena.h"
+
+#ifndef WRITEBUF
+#define WRITEBUF 16384 /* body bytes coalesced into one send */
+#endif
+
+#ifndef WRITEHEAD
+#define WRITEHEAD 16 /* room in front of the buffer for a chunk size line */
+#endif
+
+/*
+ * a response body of unknown length.  Bytes are collected until the
+ * buffer is full or the caller flushes, then sent as one write; chunked
+ * bodies go out one HTTP/1.1 chunk per write.
+ */
+struct writer {
+    int fd;
+    int chunked;	/* frame the body with Transfer-Encoding: chunked */
+    int discard;	/* HEAD: count the body but do not send it */
+    int error;		/* a send failed, the connection is done */
+    const struct in6_addr *client;	/* paced through ratePace() */
+    char *buf;
+    size_t len;
+    size_t body;	/* body bytes put so far, for the log */
+};
+
+int writerInit(struct writer *, int, const struct in6_addr *, int, int,
+    struct arena *);
+int writerPut(struct writer *, const void *, size_t);
+int writerPrintf(struct writer *, const char *, ...)
+    __attribute__((format(printf, 2, 3)));
+int writerFlush(struct writer *);
+int writerEnd(struct writer *);
+
+#endif